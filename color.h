@@ -1,12 +1,20 @@
 #ifndef COLOR_H
 #define COLOR_H
 
+#include <stdbool.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 
+// ColorIntern で得る色の番号。
+typedef unsigned short ColorHandle;
+
 void ColorInitialize(Display *aDisp);
 bool ColorIsInitialized();
+// 名前で引く。色を初めて使うときや、初期化のときに使う。
 unsigned long ColorGetPixel(const char *name);
 XftColor *ColorGetXftColor(const char *name);
+ColorHandle ColorIntern(const char *name);
+unsigned long ColorPixel(ColorHandle color);
+XftColor *ColorXftColor(ColorHandle color);
 
 #endif
@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <iconv.h>
 #include <X11/Xlib.h>
 #include <stdbool.h>
@@ -5,6 +6,7 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <string.h>
 
 #include "jisx0208.h"
 
@@ -23,6 +25,19 @@ static Display *associated_display;
 static iconv_t cd_to_latin1;
 static iconv_t cd_to_eucjp;
 
+// どのフォントで表示するかを BMP の符号位置ごとに 2 ビットで持つ表。
+// InitializeFonts で以前と同じ判定を一度ずつ行って作る。フォント内の
+// 文字コードは、Latin-1 では下位バイト、JIS X 0208 では
+// UnicodeToJisx0208 の値、UniFont では符号位置そのものである。
+enum {
+    ROUTE_UNI,
+    ROUTE_LATIN1,
+    ROUTE_JISX0208,
+};
+static uint8_t font_routes[65536 / 4];
+
+static void BuildFontRoutes();
+
 void InitializeFonts(Display *disp)
 {
     associated_display = disp;
@@ -56,6 +71,11 @@ void InitializeFonts(Display *disp)
 	perror("EUC-JP");
 	abort();
     }
+
+    BuildFontRoutes();
+    // 以後 iconv は使わない。
+    iconv_close(cd_to_latin1);
+    iconv_close(cd_to_eucjp);
 }
 
 // 名前がわるい
@@ -65,8 +85,6 @@ void ShutdownFonts()
     XFreeFont(associated_display, Jisx0208Font);
     XFreeFont(associated_display, UniFont);
     Latin1Font = Jisx0208Font = UniFont = NULL;
-    iconv_close(cd_to_latin1);
-    iconv_close(cd_to_eucjp);
 }
 
 static bool IsLatin1(XChar2b ucs2)
@@ -162,24 +180,54 @@ static XChar2b ToJisx0208(XChar2b ucs2)
     size_t idx = ((size_t) ucs2.byte1 << 8) | ucs2.byte2;
     XChar2b jis;
 
-    uint16_t jiscode = UnicodeToJisx0208[idx];
+    uint16_t jiscode = UnicodeToJisx0208(idx);
     jis.byte1 = jiscode >> 8;
     jis.byte2 = jiscode & 0xff;
     return jis;
 }
 
+static int RouteOf(unsigned int cp)
+{
+    return (font_routes[cp >> 2] >> ((cp & 3) * 2)) & 3;
+}
+
+static void BuildFontRoutes()
+{
+    memset(font_routes, 0, sizeof(font_routes));
+
+    for (unsigned int cp = 0; cp <= 0xffff; cp++) {
+	XChar2b ucs2 = { .byte1 = cp >> 8, .byte2 = cp & 0xff };
+	int route;
+
+	if (ucs2.byte1 == 0 && iscntrl(ucs2.byte2)) {
+	    route = ROUTE_UNI;
+	} else if (IsLatin1(ucs2)) {
+	    // 下位バイトをそのまま使えることを確かめておく。
+	    XChar2b latin1 = ToLatin1(ucs2);
+	    assert(ucs2.byte1 == 0 && latin1.byte2 == ucs2.byte2);
+	    route = ROUTE_LATIN1;
+	} else if (IsJisx0208(ucs2)) {
+	    route = ROUTE_JISX0208;
+	} else {
+	    route = ROUTE_UNI;
+	}
+	font_routes[cp >> 2] |= route << ((cp & 3) * 2);
+    }
+}
+
 XFontStruct *SelectFont(XChar2b ucs2, XChar2b *ch_return)
 {
-    if (ucs2.byte1 == 0 && iscntrl(ucs2.byte2)) {
-	*ch_return = ucs2;
-	return UniFont;
-    } else if (IsLatin1(ucs2)) {
-	*ch_return = ToLatin1(ucs2);
+    unsigned int cp = (ucs2.byte1 << 8) | ucs2.byte2;
+
+    switch (RouteOf(cp)) {
+    case ROUTE_LATIN1:
+	ch_return->byte1 = 0;
+	ch_return->byte2 = ucs2.byte2;
 	return Latin1Font;
-    } else if (IsJisx0208(ucs2)) {
+    case ROUTE_JISX0208:
 	*ch_return = ToJisx0208(ucs2);
 	return Jisx0208Font;
-    } else {
+    default:
 	*ch_return = ucs2;
 	return UniFont;
     }
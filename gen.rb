@@ -1,8 +1,22 @@
+# JIS0208.TXT から jisx0208.c を生成する。
+#
+#   ruby gen.rb JIS0208.TXT > jisx0208.c
+#
+# Unicode から JIS X 0208 への表は二段にする。符号位置の上位ビットで
+# ページ番号を引き、下位ビットでページ内を引く。対応する文字の無いペー
+# ジは全て 0 番のページを共有する。
+
 COL_SJIS = 0
 COL_0208 = 1
 COL_UNICODE = 2
 
-unicode_to_0208 = Array.new(0x10000)
+PAGE_BITS = 7
+PAGE_SIZE = 1 << PAGE_BITS
+NPAGES = 0x10000 / PAGE_SIZE
+
+unicode_to_0208 = Array.new(0x10000, 0)
+jisx0208_to_unicode = Array.new(94) { Array.new(94, 0) }
+mappings = []
 
 ARGF.each_line do |line|
   line.sub!(/#.*$/, '')
@@ -12,12 +26,108 @@ ARGF.each_line do |line|
   cp = row[COL_UNICODE]
   jis = row[COL_0208]
   unicode_to_0208[cp] = jis
+  jisx0208_to_unicode[(jis >> 8) - 0x21][(jis & 0xff) - 0x21] = cp
+  mappings << [cp, jis]
+end
+
+# ページに分ける。0 番は全て 0 のページ。
+pages = [Array.new(PAGE_SIZE, 0)]
+page_index = unicode_to_0208.each_slice(PAGE_SIZE).map do |page|
+  if page.all?(&:zero?)
+    0
+  else
+    pages << page
+    pages.size - 1
+  end
+end
+abort "too many pages" if pages.size > 256
+
+# 生成した表で全ての対応が往復することを確かめる。
+mappings.each do |cp, jis|
+  got = pages[page_index[cp >> PAGE_BITS]][cp & (PAGE_SIZE - 1)]
+  abort "U+%04X: expected 0x%04X, got 0x%04X" % [cp, jis, got] if got != jis
+  back = jisx0208_to_unicode[(jis >> 8) - 0x21][(jis & 0xff) - 0x21]
+  abort "0x%04X: expected U+%04X, got U+%04X" % [jis, cp, back] if back != cp
+end
+
+puts "// gen.rb によって JIS0208.TXT から生成された。編集しないこと。"
+puts "#include <inttypes.h>"
+puts "#include \"jisx0208.h\""
+puts
+puts "_Static_assert(JISX0208_PAGE_BITS == #{PAGE_BITS}, \"gen.rb と jisx0208.h で PAGE_BITS が違う\");"
+puts
+
+puts "const uint8_t Jisx0208PageIndex[#{NPAGES}] = {"
+page_index.each_slice(16) do |indices|
+  puts "    " + indices.map { |i| "%3d," % i }.join(" ")
 end
+puts "};"
+puts
 
-puts "uint16_t UnicodeToJisx0208[] = {\n"
-unicode_to_0208.each_slice(8) do |codes|
-  printf "    "
-  codes.map! { |c| c ? c : 0 }
-  puts codes.map { |c| "0x%04X, " % c }.join
+puts "const uint16_t Jisx0208Pages[#{pages.size}][#{PAGE_SIZE}] = {"
+pages.each_with_index do |page, i|
+  puts "    { // #{i}"
+  page.each_slice(8) do |codes|
+    puts "\t" + codes.map { |c| "0x%04X," % c }.join(" ")
+  end
+  puts "    },"
 end
 puts "};"
+puts
+
+puts "const uint16_t Jisx0208ToUnicodeTable[94][94] = {"
+jisx0208_to_unicode.each_with_index do |row, ku|
+  puts "    { // #{ku + 1} 区"
+  row.each_slice(8) do |codes|
+    puts "\t" + codes.map { |c| "0x%04X," % c }.join(" ")
+  end
+  puts "    },"
+end
+puts "};"
+puts
+
+# 生成された表を C から検査するためのプログラム。
+#
+#   gcc -std=c11 -DJISX0208_TEST -o jisx0208-test jisx0208.c
+#   ./jisx0208-test JIS0208.TXT
+puts <<'EOS'
+#ifdef JISX0208_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s JIS0208.TXT\n", argv[0]);
+	exit(1);
+    }
+
+    FILE *fp = fopen(argv[1], "r");
+    if (fp == NULL) {
+	perror(argv[1]);
+	exit(1);
+    }
+
+    char line[256];
+    int nmappings = 0, nerrors = 0;
+    while (fgets(line, sizeof(line), fp)) {
+	unsigned int sjis, jis, cp;
+	if (line[0] == '#' || sscanf(line, "%x %x %x", &sjis, &jis, &cp) != 3)
+	    continue;
+	nmappings++;
+	if (UnicodeToJisx0208(cp) != jis) {
+	    printf("U+%04X: expected 0x%04X, got 0x%04X\n", cp, jis, UnicodeToJisx0208(cp));
+	    nerrors++;
+	}
+	if (Jisx0208ToUnicode(jis) != cp) {
+	    printf("0x%04X: expected U+%04X, got U+%04X\n", jis, cp, Jisx0208ToUnicode(jis));
+	    nerrors++;
+	}
+    }
+    fclose(fp);
+
+    printf("%d mappings, %d errors\n", nmappings, nerrors);
+    return nerrors == 0 ? 0 : 1;
+}
+#endif
+EOS
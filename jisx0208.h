@@ -1,4 +1,31 @@
 #ifndef JISX0208_H
 #define JISX0208_H
-extern uint16_t UnicodeToJisx0208[65536];
+
+#include <inttypes.h>
+
+// jisx0208.c は gen.rb で生成する。
+#define JISX0208_PAGE_BITS 7
+extern const uint8_t Jisx0208PageIndex[65536 >> JISX0208_PAGE_BITS];
+extern const uint16_t Jisx0208Pages[][1 << JISX0208_PAGE_BITS];
+extern const uint16_t Jisx0208ToUnicodeTable[94][94];
+
+// JIS X 0208 に無い文字ならば 0 を返す。
+static inline uint16_t UnicodeToJisx0208(uint16_t cp)
+{
+    return Jisx0208Pages[Jisx0208PageIndex[cp >> JISX0208_PAGE_BITS]]
+	[cp & ((1 << JISX0208_PAGE_BITS) - 1)];
+}
+
+// jis は 0x2121 から 0x7E7E までの区点。対応する文字が無ければ 0 を
+// 返す。
+static inline uint16_t Jisx0208ToUnicode(uint16_t jis)
+{
+    unsigned int row = (jis >> 8) - 0x21;
+    unsigned int cell = (jis & 0xff) - 0x21;
+
+    if (row >= 94 || cell >= 94)
+	return 0;
+    return Jisx0208ToUnicodeTable[row][cell];
+}
+
 #endif
@@ -0,0 +1,638 @@
+// UTF-8、EUC-JP、Shift_JIS、ISO-2022-JP から UCS-2 (XChar2b) と
+// UTF-32 への変換。
+//
+//   iconv を使わない。JIS X 0208 の文字は jisx0208.c の表で Unicode
+//   にする。ASCII が 16 バイト続く所は SSE2 でまとめて広げる。
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "jisx0208.h"
+#include "transcode.h"
+
+#define CHUNK_SIZE (64 * 1024)
+
+// 文字を出力しないバイト列 (ISO-2022-JP のエスケープシーケンス)。
+#define NO_CHARACTER 0xffffffff
+
+// ISO-2022-JP で指示されている文字集合。
+enum {
+    ISO2022_ASCII,
+    ISO2022_JIS_ROMAN,
+    ISO2022_JISX0208,
+    ISO2022_KATAKANA,
+};
+
+typedef struct {
+    TextEncoding encoding;
+    int iso2022_charset;
+    // U+FFFD にした数と半角カナの数。文字コードの判定に使う。
+    size_t nsuspicious;
+} Decoder;
+
+// 先頭の文字を復号して *cp_return に設定し、そのバイト数を返す。不正
+// なバイト列は 1 バイトの U+FFFD とする。avail バイトの中で文字が途切
+// れている場合は 0 を返す。以下の Decode*Char も同じ。
+static size_t DecodeUtf8Char(const unsigned char *p, size_t avail, uint32_t *cp_return)
+{
+    unsigned char b = p[0];
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t n;
+    uint32_t cp;
+
+    if (b < 0x80) {
+	*cp_return = b;
+	return 1;
+    } else if (b < 0xc2) {
+	goto invalid;
+    } else if (b < 0xe0) {
+	n = 2;
+	cp = b & 0x1f;
+    } else if (b < 0xf0) {
+	n = 3;
+	cp = b & 0x0f;
+	if (b == 0xe0) lo = 0xa0;
+	if (b == 0xed) hi = 0x9f; // サロゲート
+    } else if (b < 0xf5) {
+	n = 4;
+	cp = b & 0x07;
+	if (b == 0xf0) lo = 0x90;
+	if (b == 0xf4) hi = 0x8f; // U+10FFFF まで
+    } else {
+	goto invalid;
+    }
+
+    for (size_t i = 1; i < n; i++) {
+	if (i == avail)
+	    return 0;
+	if (p[i] < lo || p[i] > hi)
+	    goto invalid;
+	lo = 0x80, hi = 0xbf;
+	cp = (cp << 6) | (p[i] & 0x3f);
+    }
+    *cp_return = cp;
+    return n;
+
+invalid:
+    *cp_return = REPLACEMENT_CHARACTER;
+    return 1;
+}
+
+// 区点 (0x2121〜0x7e7e) を Unicode にする。
+static uint32_t JisToUnicode(unsigned int byte1, unsigned int byte2)
+{
+    uint16_t cp = Jisx0208ToUnicode((byte1 << 8) | byte2);
+    return cp ? cp : REPLACEMENT_CHARACTER;
+}
+
+// JIS X 0201 の片仮名 (0x21〜0x5f) を半角カナにする。
+static uint32_t KatakanaToUnicode(unsigned int byte)
+{
+    return 0xff61 + (byte - 0x21);
+}
+
+static size_t DecodeEucJpChar(const unsigned char *p, size_t avail, uint32_t *cp_return)
+{
+    unsigned char b = p[0];
+
+    if (b < 0x80) {
+	*cp_return = b;
+	return 1;
+    } else if (b >= 0xa1 && b <= 0xfe) {
+	if (avail < 2)
+	    return 0;
+	if (p[1] < 0xa1 || p[1] > 0xfe)
+	    goto invalid;
+	*cp_return = JisToUnicode(b & 0x7f, p[1] & 0x7f);
+	return 2;
+    } else if (b == 0x8e) {
+	// SS2: 半角カナ
+	if (avail < 2)
+	    return 0;
+	if (p[1] < 0xa1 || p[1] > 0xdf)
+	    goto invalid;
+	*cp_return = KatakanaToUnicode(p[1] & 0x7f);
+	return 2;
+    } else if (b == 0x8f) {
+	// SS3: JIS X 0212 の表は持っていない。
+	if (avail < 3)
+	    return 0;
+	if (p[1] < 0xa1 || p[1] > 0xfe || p[2] < 0xa1 || p[2] > 0xfe)
+	    goto invalid;
+	*cp_return = REPLACEMENT_CHARACTER;
+	return 3;
+    }
+
+invalid:
+    *cp_return = REPLACEMENT_CHARACTER;
+    return 1;
+}
+
+static size_t DecodeShiftJisChar(const unsigned char *p, size_t avail, uint32_t *cp_return)
+{
+    unsigned char b = p[0];
+
+    if (b < 0x80) {
+	*cp_return = b;
+	return 1;
+    } else if (b >= 0xa1 && b <= 0xdf) {
+	*cp_return = KatakanaToUnicode(b & 0x7f);
+	return 1;
+    } else if ((b >= 0x81 && b <= 0x9f) || (b >= 0xe0 && b <= 0xfc)) {
+	if (avail < 2)
+	    return 0;
+	unsigned char t = p[1];
+	if (t < 0x40 || t == 0x7f || t > 0xfc)
+	    goto invalid;
+	if (b >= 0xf0) {
+	    // 外字
+	    *cp_return = REPLACEMENT_CHARACTER;
+	    return 2;
+	}
+
+	// 2 つの区を 1 バイトにまとめているのを戻す。
+	unsigned int byte1 = ((b <= 0x9f) ? b - 0x70 : b - 0xb0) * 2;
+	unsigned int byte2;
+	if (t >= 0x9f) {
+	    byte2 = t - 0x7e;
+	} else {
+	    byte1--;
+	    byte2 = t - ((t >= 0x80) ? 0x20 : 0x1f);
+	}
+	*cp_return = JisToUnicode(byte1, byte2);
+	return 2;
+    }
+
+invalid:
+    *cp_return = REPLACEMENT_CHARACTER;
+    return 1;
+}
+
+static size_t DecodeIso2022JpChar(Decoder *d, const unsigned char *p, size_t avail, uint32_t *cp_return)
+{
+    unsigned char b = p[0];
+
+    if (b == 0x1b) {
+	if (avail < 3)
+	    return 0;
+	int charset = -1;
+	if (p[1] == '(' && p[2] == 'B')
+	    charset = ISO2022_ASCII;
+	else if (p[1] == '(' && p[2] == 'J')
+	    charset = ISO2022_JIS_ROMAN;
+	else if (p[1] == '(' && p[2] == 'I')
+	    charset = ISO2022_KATAKANA;
+	else if (p[1] == '$' && (p[2] == 'B' || p[2] == '@'))
+	    charset = ISO2022_JISX0208;
+	if (charset == -1)
+	    goto invalid;
+	d->iso2022_charset = charset;
+	*cp_return = NO_CHARACTER;
+	return 3;
+    } else if (b >= 0x80) {
+	goto invalid;
+    } else if (b < 0x21 || b == 0x7f) {
+	// 制御文字はどの文字集合でもそのまま通す。
+	*cp_return = b;
+	return 1;
+    }
+
+    switch (d->iso2022_charset) {
+    case ISO2022_JISX0208:
+	if (avail < 2)
+	    return 0;
+	if (p[1] < 0x21 || p[1] > 0x7e)
+	    goto invalid;
+	*cp_return = JisToUnicode(b, p[1]);
+	return 2;
+    case ISO2022_KATAKANA:
+	if (b > 0x5f)
+	    goto invalid;
+	*cp_return = KatakanaToUnicode(b);
+	return 1;
+    case ISO2022_JIS_ROMAN:
+	if (b == 0x5c)
+	    *cp_return = 0xa5; // YEN SIGN
+	else if (b == 0x7e)
+	    *cp_return = 0x203e; // OVERLINE
+	else
+	    *cp_return = b;
+	return 1;
+    default:
+	*cp_return = b;
+	return 1;
+    }
+
+invalid:
+    *cp_return = REPLACEMENT_CHARACTER;
+    return 1;
+}
+
+static inline void Put(XChar2b *ucs2, uint32_t *utf32, size_t i, uint32_t cp)
+{
+    if (ucs2) {
+	uint32_t bmp = (cp > 0xffff) ? REPLACEMENT_CHARACTER : cp;
+	ucs2[i].byte1 = bmp >> 8;
+	ucs2[i].byte2 = bmp & 0xff;
+    }
+    if (utf32)
+	utf32[i] = cp;
+}
+
+// 今の状態で ASCII をそのまま出力してよければ true。
+static inline bool PassesAscii(const Decoder *d)
+{
+    return d->encoding != TEXT_ENCODING_ISO_2022_JP || d->iso2022_charset == ISO2022_ASCII;
+}
+
+static size_t Decode(Decoder *d, const unsigned char *in, size_t inlen, bool final,
+		     XChar2b *ucs2, uint32_t *utf32, size_t *consumed)
+{
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < inlen) {
+#ifdef __SSE2__
+	if (i + 16 <= inlen && PassesAscii(d)) {
+	    __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+	    unsigned mask = _mm_movemask_epi8(v);
+	    // ISO-2022-JP では ESC で文字集合が切り替わる。
+	    if (d->encoding == TEXT_ENCODING_ISO_2022_JP)
+		mask |= _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x1b)));
+	    if (mask == 0) {
+		__m128i zero = _mm_setzero_si128();
+		// XChar2b は上位バイトが先なので、0 を前に置いて広げる。
+		if (ucs2) {
+		    _mm_storeu_si128((__m128i *) (ucs2 + o), _mm_unpacklo_epi8(zero, v));
+		    _mm_storeu_si128((__m128i *) (ucs2 + o + 8), _mm_unpackhi_epi8(zero, v));
+		}
+		if (utf32) {
+		    __m128i lo = _mm_unpacklo_epi8(v, zero);
+		    __m128i hi = _mm_unpackhi_epi8(v, zero);
+		    _mm_storeu_si128((__m128i *) (utf32 + o), _mm_unpacklo_epi16(lo, zero));
+		    _mm_storeu_si128((__m128i *) (utf32 + o + 4), _mm_unpackhi_epi16(lo, zero));
+		    _mm_storeu_si128((__m128i *) (utf32 + o + 8), _mm_unpacklo_epi16(hi, zero));
+		    _mm_storeu_si128((__m128i *) (utf32 + o + 12), _mm_unpackhi_epi16(hi, zero));
+		}
+		i += 16;
+		o += 16;
+		continue;
+	    }
+	}
+#endif
+	uint32_t cp;
+	size_t n;
+	switch (d->encoding) {
+	case TEXT_ENCODING_EUC_JP:
+	    n = DecodeEucJpChar(in + i, inlen - i, &cp);
+	    break;
+	case TEXT_ENCODING_SHIFT_JIS:
+	    n = DecodeShiftJisChar(in + i, inlen - i, &cp);
+	    break;
+	case TEXT_ENCODING_ISO_2022_JP:
+	    n = DecodeIso2022JpChar(d, in + i, inlen - i, &cp);
+	    break;
+	default:
+	    n = DecodeUtf8Char(in + i, inlen - i, &cp);
+	    break;
+	}
+	if (n == 0) {
+	    if (!final)
+		break; // 続きは次のチャンクにある。
+	    // ファイルの終わりで途切れている。
+	    cp = REPLACEMENT_CHARACTER;
+	    n = inlen - i;
+	}
+	i += n;
+	if (cp == NO_CHARACTER)
+	    continue;
+	if (cp == REPLACEMENT_CHARACTER || (cp >= 0xff61 && cp <= 0xff9f))
+	    d->nsuspicious++;
+	Put(ucs2, utf32, o++, cp);
+    }
+
+    if (consumed)
+	*consumed = i;
+    return o;
+}
+
+// ファイルの先頭 len バイトから文字コードを推測する。
+//
+//   8 ビットのバイトが無ければ、JIS X 0208 への切り替えがあるかどうか
+//   で ISO-2022-JP と UTF-8 (ASCII) を区別する。あれば UTF-8、EUC-JP、
+//   Shift_JIS として復号してみて、U+FFFD と半角カナの最も少ないものを
+//   選ぶ。同数ならばこの順に優先する。
+static TextEncoding DetectEncoding(const unsigned char *in, size_t len, bool final)
+{
+    bool has_8bit = false;
+    bool has_jis_escape = false;
+
+    for (size_t i = 0; i < len; i++) {
+	if (in[i] >= 0x80)
+	    has_8bit = true;
+	else if (in[i] == 0x1b && i + 1 < len && in[i + 1] == '$')
+	    has_jis_escape = true;
+    }
+    if (!has_8bit)
+	return has_jis_escape ? TEXT_ENCODING_ISO_2022_JP : TEXT_ENCODING_UTF8;
+
+    static const TextEncoding candidates[] = {
+	TEXT_ENCODING_UTF8, TEXT_ENCODING_EUC_JP, TEXT_ENCODING_SHIFT_JIS,
+    };
+    TextEncoding best = TEXT_ENCODING_UTF8;
+    size_t best_score = SIZE_MAX;
+
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+	Decoder d = { .encoding = candidates[i] };
+	Decode(&d, in, len, final, NULL, NULL, NULL);
+	if (d.nsuspicious < best_score) {
+	    best = candidates[i];
+	    best_score = d.nsuspicious;
+	}
+    }
+    return best;
+}
+
+// 最初のチャンクを読んだところで復号器を用意する。
+static void StartDecoder(Decoder *d, TextEncoding encoding,
+			 const unsigned char *in, size_t len, bool final)
+{
+    memset(d, 0, sizeof(Decoder));
+    if (encoding == TEXT_ENCODING_AUTO)
+	encoding = DetectEncoding(in, len, final);
+    d->encoding = encoding;
+}
+
+size_t TranscodeUtf8(const unsigned char *in, size_t inlen, bool final,
+		     XChar2b *ucs2, uint32_t *utf32, size_t *consumed)
+{
+    Decoder d = { .encoding = TEXT_ENCODING_UTF8 };
+
+    return Decode(&d, in, inlen, final, ucs2, utf32, consumed);
+}
+
+const char *TextEncodingName(TextEncoding encoding)
+{
+    switch (encoding) {
+    case TEXT_ENCODING_UTF8:		return "UTF-8";
+    case TEXT_ENCODING_EUC_JP:		return "EUC-JP";
+    case TEXT_ENCODING_SHIFT_JIS:	return "Shift_JIS";
+    case TEXT_ENCODING_ISO_2022_JP:	return "ISO-2022-JP";
+    default:				return "auto";
+    }
+}
+
+static void *Grow(void *ptr, size_t size)
+{
+    void *res = realloc(ptr, size);
+    if (res == NULL) {
+	perror("realloc");
+	exit(1);
+    }
+    return res;
+}
+
+TranscodedText TranscodeFile(const char *filepath, TextEncoding encoding, bool want_utf32)
+{
+    FILE *fp = fopen(filepath, "r");
+    if ( fp == NULL ) {
+	perror(filepath);
+	exit(1);
+    }
+
+    // どの文字コードでも文字数はバイト数を越えないので、普通のファイル
+    // ならば最初に確保した領域で足りる。
+    size_t capacity = CHUNK_SIZE;
+    struct stat st;
+    if ( fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 )
+	capacity = st.st_size;
+
+    TranscodedText t = { NULL, NULL, 0, encoding };
+    t.ucs2 = Grow(NULL, capacity * sizeof(XChar2b));
+    if (want_utf32)
+	t.utf32 = Grow(NULL, capacity * sizeof(uint32_t));
+
+    // 前のチャンクの末尾で途切れた文字のために 3 バイト余分に取る。
+    unsigned char *buf = Grow(NULL, CHUNK_SIZE + 3);
+    size_t carry = 0;
+    bool final = false;
+    bool started = false;
+    Decoder d;
+
+    while (!final) {
+	size_t n = fread(buf + carry, 1, CHUNK_SIZE, fp);
+	final = (n < CHUNK_SIZE);
+	size_t avail = carry + n;
+
+	if (!started) {
+	    StartDecoder(&d, encoding, buf, avail, final);
+	    t.encoding = d.encoding;
+	    started = true;
+	}
+
+	if (t.length + avail > capacity) {
+	    capacity = (capacity * 2 > t.length + avail) ? capacity * 2 : t.length + avail;
+	    t.ucs2 = Grow(t.ucs2, capacity * sizeof(XChar2b));
+	    if (want_utf32)
+		t.utf32 = Grow(t.utf32, capacity * sizeof(uint32_t));
+	}
+
+	size_t consumed;
+	t.length += Decode(&d, buf, avail, final,
+			   t.ucs2 + t.length,
+			   want_utf32 ? t.utf32 + t.length : NULL,
+			   &consumed);
+	carry = avail - consumed;
+	memmove(buf, buf + consumed, carry);
+    }
+    if ( ferror(fp) ) {
+	perror(filepath);
+	exit(1);
+    }
+    fclose(fp);
+    free(buf);
+
+    return t;
+}
+
+void TranscodedTextFree(TranscodedText *t)
+{
+    free(t->ucs2);
+    free(t->utf32);
+    t->ucs2 = NULL;
+    t->utf32 = NULL;
+    t->length = 0;
+}
+
+struct TextLoader {
+    XChar2b *ucs2;
+    // 読み込みスレッドが書き込んだ文字数。
+    atomic_size_t length;
+    atomic_bool done;
+
+    FILE *fp;
+    const char *filepath;
+    TextEncoding encoding;
+    size_t file_size;
+    pthread_t thread;
+    // 進捗を知らせるパイプ。
+    int read_fd, write_fd;
+    // メインスレッドが読み込みの終了を確認したら true。
+    bool finished;
+};
+
+static void Notify(TextLoader *loader)
+{
+    // パイプが一杯ならば、まだ読まれていない通知があるので捨ててよい。
+    if (write(loader->write_fd, "", 1) == -1 && errno != EAGAIN) {
+	perror("write");
+	exit(1);
+    }
+}
+
+static void *LoaderMain(void *arg)
+{
+    TextLoader *loader = arg;
+    unsigned char *buf = Grow(NULL, CHUNK_SIZE + 3);
+    size_t carry = 0;
+    size_t remaining = loader->file_size;
+    size_t length = 0;
+    bool final = false;
+    bool started = false;
+    Decoder d;
+
+    // 読み込み中にファイルが伸びても、確保した領域を越えないように
+    // file_size バイトまでしか読まない。
+    while (!final) {
+	size_t want = (remaining < CHUNK_SIZE) ? remaining : CHUNK_SIZE;
+	size_t n = fread(buf + carry, 1, want, loader->fp);
+	remaining -= n;
+	final = (n < want || remaining == 0);
+	size_t avail = carry + n;
+
+	if (!started) {
+	    StartDecoder(&d, loader->encoding, buf, avail, final);
+	    started = true;
+	}
+
+	size_t consumed;
+	length += Decode(&d, buf, avail, final, loader->ucs2 + length, NULL, &consumed);
+	carry = avail - consumed;
+	memmove(buf, buf + consumed, carry);
+
+	atomic_store_explicit(&loader->length, length, memory_order_release);
+	Notify(loader);
+    }
+    if ( ferror(loader->fp) ) {
+	perror(loader->filepath);
+	exit(1);
+    }
+    fclose(loader->fp);
+    free(buf);
+
+    atomic_store_explicit(&loader->done, true, memory_order_release);
+    Notify(loader);
+    return NULL;
+}
+
+TextLoader *TextLoaderStart(const char *filepath, TextEncoding encoding)
+{
+    TextLoader *loader = Grow(NULL, sizeof(TextLoader));
+    memset(loader, 0, sizeof(TextLoader));
+    loader->filepath = filepath;
+    loader->encoding = encoding;
+    loader->read_fd = loader->write_fd = -1;
+
+    struct stat st;
+    if ( stat(filepath, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ) {
+	// パイプなどは大きさが分からないので、全て読んでしまう。
+	TranscodedText t = TranscodeFile(filepath, encoding, false);
+	loader->ucs2 = t.ucs2;
+	atomic_init(&loader->length, t.length);
+	atomic_init(&loader->done, true);
+	loader->finished = true;
+	return loader;
+    }
+
+    loader->fp = fopen(filepath, "r");
+    if ( loader->fp == NULL ) {
+	perror(filepath);
+	exit(1);
+    }
+    loader->file_size = st.st_size;
+    // 文字数はバイト数を越えない。
+    loader->ucs2 = Grow(NULL, loader->file_size * sizeof(XChar2b));
+    atomic_init(&loader->length, 0);
+    atomic_init(&loader->done, false);
+
+    int fds[2];
+    if ( pipe(fds) == -1 ) {
+	perror("pipe");
+	exit(1);
+    }
+    loader->read_fd = fds[0];
+    loader->write_fd = fds[1];
+    fcntl(loader->read_fd, F_SETFL, O_NONBLOCK);
+    fcntl(loader->write_fd, F_SETFL, O_NONBLOCK);
+
+    int err = pthread_create(&loader->thread, NULL, LoaderMain, loader);
+    if (err != 0) {
+	fprintf(stderr, "pthread_create: %s\n", strerror(err));
+	exit(1);
+    }
+    return loader;
+}
+
+// 読み込みが終わっていれば -1 を返す。
+int TextLoaderFd(TextLoader *loader)
+{
+    return loader->read_fd;
+}
+
+bool TextLoaderIsDone(TextLoader *loader)
+{
+    return loader->finished;
+}
+
+// 溜まった通知を読み捨てて、現在読み込まれている文字数を返す。読み込み
+// が終わっていれば、スレッドとパイプを片付ける。
+size_t TextLoaderReceive(TextLoader *loader)
+{
+    if (loader->finished)
+	return atomic_load(&loader->length);
+
+    char buf[256];
+    while (read(loader->read_fd, buf, sizeof(buf)) > 0)
+	;
+
+    // done を先に読む。done が true ならば、その前に書かれた length は
+    // 最終的な値である。
+    bool done = atomic_load_explicit(&loader->done, memory_order_acquire);
+    size_t length = atomic_load_explicit(&loader->length, memory_order_acquire);
+    if (done) {
+	pthread_join(loader->thread, NULL);
+	close(loader->read_fd);
+	close(loader->write_fd);
+	loader->read_fd = loader->write_fd = -1;
+	loader->finished = true;
+    }
+    return length;
+}
+
+XChar2b *TextLoaderText(TextLoader *loader)
+{
+    return loader->ucs2;
+}
@@ -0,0 +1,69 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include <X11/Xlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 置換文字 U+FFFD。BMP 外の文字と不正なバイト列はこれになる。
+#define REPLACEMENT_CHARACTER 0xfffd
+
+typedef enum {
+    TEXT_ENCODING_AUTO,
+    TEXT_ENCODING_UTF8,
+    TEXT_ENCODING_EUC_JP,
+    TEXT_ENCODING_SHIFT_JIS,
+    TEXT_ENCODING_ISO_2022_JP,
+} TextEncoding;
+
+// テキストを変換した結果。
+//
+//   ucs2 は BMP の文字だけを持ち、それ以外は U+FFFD に置き換えられる。
+//   utf32 は実際の符号位置を持つので、BMP 外の文字を UniFont で表示し
+//   たい場合はこちらを見る。どちらも NUL 終端はしない。
+typedef struct {
+    XChar2b *ucs2;
+    uint32_t *utf32;
+    size_t length;
+    // 元の文字コード。TEXT_ENCODING_AUTO を指定した場合は推測したもの。
+    TextEncoding encoding;
+} TranscodedText;
+
+const char *TextEncodingName(TextEncoding encoding);
+// ファイルを一定の大きさに区切って読みながら変換する。ファイル全体を
+// 元の文字コードのままメモリに置くことはない。TEXT_ENCODING_AUTO なら
+// ば最初のチャンクから文字コードを推測する。utf32 が要らなければ
+// want_utf32 を false にする。
+TranscodedText TranscodeFile(const char *filepath, TextEncoding encoding, bool want_utf32);
+void TranscodedTextFree(TranscodedText *t);
+// in から inlen バイトを変換し、出力した文字数を返す。ucs2 と utf32
+// はそれぞれ inlen 文字分の領域を持つこと。どちらも NULL でよい。
+// final が false の場合、末尾で途切れた文字は変換せずに残し、その手前
+// までのバイト数を *consumed に設定する。
+size_t TranscodeUtf8(const unsigned char *in, size_t inlen, bool final,
+		     XChar2b *ucs2, uint32_t *utf32, size_t *consumed);
+
+// 別スレッドでファイルを読みながら変換する。
+//
+//   テキストの領域はファイルの大きさから最初に確保されるので、読み込
+//   み中に動くことはない。読み込みが進むたびに TextLoaderFd のパイプが
+//   読み出し可能になるので、select で待って TextLoaderReceive を呼ぶ。
+//   通常のファイルでなければ、TextLoaderStart の中で全て読み込む。
+typedef struct TextLoader TextLoader;
+
+int TextLoaderFd(TextLoader *loader);
+bool TextLoaderIsDone(TextLoader *loader);
+size_t TextLoaderReceive(TextLoader *loader);
+TextLoader *TextLoaderStart(const char *filepath, TextEncoding encoding);
+XChar2b *TextLoaderText(TextLoader *loader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
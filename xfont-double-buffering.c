@@ -5,7 +5,6 @@
 
 #include <assert.h>
 #include <ctype.h>
-#include <iconv.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,9 +15,9 @@
 #include <time.h>
 #include <X11/Xlib.h>
 #include <X11/extensions/Xdbe.h>
-#include <alloca.h>
 
 #include "util.h"
+#include "transcode.h"
 #include "font.h"
 
 #define DEFAULT_FONT "-gnu-unifont-medium-r-normal-sans-16-160-75-75-c-80-iso10646-1"
@@ -40,6 +39,9 @@ static XFontStruct	*default_font;
 // テキスト情報
 static XChar2b		*text;
 static size_t		 text_length;
+// 読み込み中は true。text_length は届いた分だけを表わす。
+static TextLoader	*loader;
+static bool		 loading;
 
 // カーソル情報
 //
@@ -87,11 +89,12 @@ bool IsPrint(XChar2b a)
     return false;
 }
 
-// ページ区切り位置を計算して、pages, npages を変更する。
-void Paginate()
+// first 番目以降のページ区切り位置を計算して、pages, npages を変更す
+// る。それより前のページは変わらないものとする。
+void PaginateFrom(size_t first)
 {
-    Page *current_page = pages;
-    size_t previous_end = 0;
+    Page *current_page = pages + first;
+    size_t previous_end = current_page->start;
 
     printf("text_length = %zu\n", text_length);
     do {
@@ -106,6 +109,13 @@ void Paginate()
     npages = current_page - pages;
 }
 
+// ページ区切り位置を計算して、pages, npages を変更する。
+void Paginate()
+{
+    pages[0].start = 0;
+    PaginateFrom(0);
+}
+
 bool ForbiddenAtStart(XChar2b ch)
 {
     // 0x3001 [、]
@@ -221,7 +231,8 @@ size_t FillPage(size_t start, Page *page, bool draw)
 	    }
 	}
     }
-    if (draw) {
+    // 読み込み中は、まだ文書の終わりではない。
+    if (draw && !loading) {
 	GC gc = XCreateGC(disp, win, 0, NULL);
 	XCopyGC(disp, default_gc, GCFont, gc);
 	XSetForeground(disp, gc, WhitePixel(disp, 0));
@@ -423,39 +434,34 @@ void UsageExit()
 
 void LoadFile(const char *filepath)
 {
-    // 前半で UTF8 ファイルをロードし、後半で UCS2 に変換する。
+    // テキストファイルを UCS2 に変換して読み込む。文字コードは UTF-8、
+    // EUC-JP、Shift_JIS、ISO-2022-JP から推測する。
     // ビッグエンディアンの UCS2 は XChar2b 構造体とバイナリ互換性を持つ。
-    FILE *fp = fopen(filepath, "r");
-    if ( fp == NULL ) {
-	perror(filepath);
-	exit(1);
-    }
-    struct stat st;
-    if ( stat(filepath, &st) == -1 ) {
-	perror(filepath);
-	exit(1);
-    }
-    char *utf8 = alloca(st.st_size + 1);
-    if ( fread(utf8, 1, st.st_size, fp) != st.st_size) {
-	fprintf(stderr, "warning: size mismatch\n");
-    }
-    fclose(fp);
+    // BMP 外の文字は U+FFFD になる。
+    //
+    // 読み込みは別のスレッドで進むので、届いた分から表示できる。
+    loader = TextLoaderStart(filepath, TEXT_ENCODING_AUTO);
+    text = TextLoaderText(loader);
+    text_length = TextLoaderReceive(loader);
+    loading = !TextLoaderIsDone(loader);
+}
+
+// 読み込みスレッドから届いたテキストを取り込み、最後のページから先を
+// ページ分けし直す。最後のページを表示していれば再描画する。
+void ReceiveText()
+{
+    text_length = TextLoaderReceive(loader);
+    loading = !TextLoaderIsDone(loader);
 
-    iconv_t cd = iconv_open("UCS-2BE", "UTF-8");
+    // まだ最初の Expose が来ていない。
+    if (npages == 0)
+	return;
 
-    size_t inbytesleft = st.st_size;
-    // UTF-8 を UCS2 に変換した場合、最大で二倍のバイト数を必要とする。
-    // NUL 終端はしない。
-    size_t outbytesleft = st.st_size * 2;
-    text = malloc(outbytesleft);
-    char *outptr = (char *) text;
+    bool on_last_page = (GetCurrentPage() == &pages[npages - 1]);
+    PaginateFrom(npages - 1);
 
-    if ( iconv(cd, &utf8, &inbytesleft, &outptr, &outbytesleft) == -1) {
-	perror(PROGRAM_NAME);
-	exit(1);
-    }
-    text_length = (XChar2b *) outptr - text;
-    iconv_close(cd);
+    if (on_last_page)
+	Redraw();
 }
 
 #include <X11/keysym.h>
@@ -487,7 +493,8 @@ void HandleKeyPress(XKeyEvent *ev)
 	needs_redraw = true;
 	break;
     case XK_Delete:
-	if (cursor_position < text_length) {
+	// 読み込み中はテキストを変更しない。
+	if (!loading && cursor_position < text_length) {
 	    memmove(&text[cursor_position], &text[cursor_position+1],
 		    sizeof(text[0]) * (text_length - cursor_position - 1));
 	    text_length--;
@@ -495,7 +502,7 @@ void HandleKeyPress(XKeyEvent *ev)
 	}
 	break;
     case XK_BackSpace:
-	if (cursor_position > 0) {
+	if (!loading && cursor_position > 0) {
 	    memmove(&text[cursor_position-1], &text[cursor_position],
 		    sizeof(text[0]) * (text_length - cursor_position));
 	    text_length--;
@@ -571,6 +578,8 @@ void HandleKeyPress(XKeyEvent *ev)
     }
 }
 
+#include <sys/select.h>
+
 int main(int argc, char *argv[])
 {
     if (argc != 2)
@@ -582,6 +591,23 @@ int main(int argc, char *argv[])
     XEvent ev;
 
     while (1) { // イベントループ
+	if (loading && !XPending(disp)) {
+	    // X のイベントか、読み込みの進捗を待つ。
+	    int xfd = ConnectionNumber(disp);
+	    int lfd = TextLoaderFd(loader);
+	    fd_set readfds;
+
+	    FD_ZERO(&readfds);
+	    FD_SET(xfd, &readfds);
+	    FD_SET(lfd, &readfds);
+	    if (select(int_max(xfd, lfd) + 1, &readfds, NULL, NULL, NULL) == -1) {
+		perror("select");
+		exit(1);
+	    }
+	    if (FD_ISSET(lfd, &readfds))
+		ReceiveText();
+	    continue;
+	}
 	XNextEvent(disp, &ev);
 
 	switch (ev.type) {
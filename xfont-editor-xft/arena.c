@@ -0,0 +1,123 @@
+// レイアウト用のアリーナ。
+//
+//   チャンクは足りなくなるたびに倍の大きさで確保する。ArenaReset は最
+//   も大きいチャンクだけを残すので、同じ程度の大きさのレイアウトを繰
+//   り返すうちに、GC からの確保は起こらなくなる。
+#include <assert.h>
+#include <gc.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ALIGNMENT 16
+// チャンクは倍々に大きくなるので、これだけあれば足りる。
+#define MAX_CHUNKS 48
+
+typedef struct {
+    char *data;
+    size_t size;
+} Chunk;
+
+struct Arena {
+    // チャンクの領域はポインタを含まないものとして確保するので、チャ
+    // ンクを指すポインタは全てここに持つ。最後の要素が今使っているチャ
+    // ンク。
+    Chunk chunks[MAX_CHUNKS];
+    size_t nchunks;
+    // 今のチャンクで使った量。
+    size_t used;
+    // 最後に確保した領域。ArenaGrow でその場で広げられるかを調べる。
+    void *last;
+    ArenaStats stats;
+};
+
+static inline size_t AlignUp(size_t n)
+{
+    return (n + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+}
+
+static void AddChunk(Arena *arena, size_t size)
+{
+    assert(arena->nchunks < MAX_CHUNKS);
+
+    Chunk *chunk = &arena->chunks[arena->nchunks++];
+    chunk->data = GC_MALLOC_ATOMIC(size);
+    chunk->size = size;
+    arena->used = 0;
+    arena->stats.chunk_allocations++;
+}
+
+static inline Chunk *CurrentChunk(Arena *arena)
+{
+    return &arena->chunks[arena->nchunks - 1];
+}
+
+Arena *ArenaCreate(size_t initial_size)
+{
+    Arena *arena = GC_MALLOC(sizeof(Arena));
+
+    AddChunk(arena, AlignUp(initial_size ? initial_size : ALIGNMENT));
+    return arena;
+}
+
+void *ArenaAlloc(Arena *arena, size_t size)
+{
+    size = AlignUp(size);
+
+    if (arena->used + size > CurrentChunk(arena)->size) {
+	size_t chunk_size = CurrentChunk(arena)->size * 2;
+	while (chunk_size < size)
+	    chunk_size *= 2;
+	AddChunk(arena, chunk_size);
+    }
+
+    void *ptr = CurrentChunk(arena)->data + arena->used;
+    arena->used += size;
+    arena->last = ptr;
+    arena->stats.allocations++;
+    arena->stats.used += size;
+    if (arena->stats.used > arena->stats.peak)
+	arena->stats.peak = arena->stats.used;
+    return ptr;
+}
+
+void *ArenaGrow(Arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    if (ptr == NULL)
+	return ArenaAlloc(arena, new_size);
+
+    assert(new_size >= old_size);
+    old_size = AlignUp(old_size);
+    new_size = AlignUp(new_size);
+
+    // 最後に確保したものならば、その場で広げられるかもしれない。
+    if (ptr == arena->last &&
+	(char *) ptr + new_size <= CurrentChunk(arena)->data + CurrentChunk(arena)->size) {
+	arena->used += new_size - old_size;
+	arena->stats.used += new_size - old_size;
+	if (arena->stats.used > arena->stats.peak)
+	    arena->stats.peak = arena->stats.used;
+	return ptr;
+    }
+
+    void *new_ptr = ArenaAlloc(arena, new_size);
+    memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
+}
+
+void ArenaReset(Arena *arena)
+{
+    // 最後のチャンクが最も大きい。それ以外は解放する。
+    for (size_t i = 0; i + 1 < arena->nchunks; i++)
+	GC_FREE(arena->chunks[i].data);
+    arena->chunks[0] = *CurrentChunk(arena);
+    arena->nchunks = 1;
+    arena->used = 0;
+    arena->last = NULL;
+    arena->stats.used = 0;
+}
+
+void ArenaGetStats(Arena *arena, ArenaStats *stats_return)
+{
+    *stats_return = arena->stats;
+}
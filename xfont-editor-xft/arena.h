@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// レイアウトの一回分の領域を積み上げて確保し、次のレイアウトの前にま
+// とめて解放する。
+//
+//   領域はポインタを含まないものとして確保されるので、GC の管理する
+//   オブジェクトへのポインタを置いてはいけない。
+typedef struct Arena Arena;
+
+typedef struct {
+    // ArenaAlloc と ArenaGrow で領域を得た回数。
+    unsigned long allocations;
+    // チャンクを GC から確保した回数。
+    unsigned long chunk_allocations;
+    size_t used;
+    size_t peak;
+} ArenaStats;
+
+void *ArenaAlloc(Arena *arena, size_t size);
+Arena *ArenaCreate(size_t initial_size);
+void ArenaGetStats(Arena *arena, ArenaStats *stats_return);
+// 最後に確保した ptr を new_size バイトに広げる。最後に確保したもので
+// なければ、あるいは今のチャンクに入らなければ、新しく確保してコピー
+// する。
+void *ArenaGrow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+// 確保したものを全て捨てる。最も大きいチャンクだけを残して再利用する。
+void ArenaReset(Arena *arena);
+
+#endif
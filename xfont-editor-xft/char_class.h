@@ -0,0 +1,42 @@
+#ifndef CHAR_CLASS_H
+#define CHAR_CLASS_H
+
+#include <stdint.h>
+
+// 文字クラス。一つの文字が複数のクラスに属することもある。
+//
+//   char_class.c は gen_char_class.rb で char_class.txt から生成する。
+//   クラスを変えるときは char_class.txt を直して生成し直すこと。
+
+// 行頭禁止文字
+#define CHAR_FORBIDDEN_AT_START 0x01
+// 行末禁止文字
+#define CHAR_FORBIDDEN_AT_END 0x02
+// 始め括弧類
+#define CHAR_OPEN_PAREN 0x04
+// 終わり括弧類
+#define CHAR_CLOSE_PAREN 0x08
+// 読点類
+#define CHAR_COMMA 0x10
+// 句点類
+#define CHAR_PERIOD 0x20
+// 中点類
+#define CHAR_MIDDLE_DOT 0x40
+// 英単語を作る ASCII 文字
+#define CHAR_WORD 0x80
+
+#define CHAR_CLASS_PAGE_BITS 7
+extern const uint8_t CharClassPageIndex[65536 >> CHAR_CLASS_PAGE_BITS];
+extern const uint8_t CharClassPages[][1 << CHAR_CLASS_PAGE_BITS];
+
+// 符号位置 cp の文字が属するクラスのビットの組。基本多言語面の外の文
+// 字はどのクラスにも属さない。
+static inline unsigned int CharClassOf(uint32_t cp)
+{
+    if (cp >= 0x10000)
+	return 0;
+    return CharClassPages[CharClassPageIndex[cp >> CHAR_CLASS_PAGE_BITS]]
+	[cp & ((1 << CHAR_CLASS_PAGE_BITS) - 1)];
+}
+
+#endif
@@ -1,15 +1,18 @@
 // カラーモジュール
+//
+//   色は名前で ColorIntern して得た ColorHandle で指定する。確保は最
+//   初に ColorIntern したときに一度だけ行うので、描画のたびに名前を比
+//   較したりサーバーに問い合わせたりしなくて済む。
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 #include <gc.h>
 
-typedef struct {
-    char *name;
-    XColor color;
-} XColorEntry;
+#include "color.h"
 
 typedef struct {
     char *name;
@@ -18,10 +21,7 @@ typedef struct {
 
 #define MAX_COLORS 1024
 
-// static XColorEntry x_color_table[1024];
-// static size_t num_x_colors;
-
-static XftColorEntry xft_color_table[1024];
+static XftColorEntry xft_color_table[MAX_COLORS];
 static size_t num_xft_colors;
 
 static Display *disp;
@@ -40,22 +40,13 @@ bool ColorIsInitialized()
     return disp != NULL;
 }
 
-unsigned long ColorGetPixel(const char *name)
+ColorHandle ColorIntern(const char *name)
 {
     assert(ColorIsInitialized());
 
-    XColor color;
-    XParseColor(disp, colormap, name, &color);
-    XAllocColor(disp, colormap, &color);
-
-    return color.pixel;
-}
-
-XftColor *ColorGetXftColor(const char *name)
-{
-    for (int i = 0; i < num_xft_colors; i++) {
+    for (size_t i = 0; i < num_xft_colors; i++) {
 	if (strcmp(xft_color_table[i].name, name) == 0) {
-	    return &xft_color_table[i].color;
+	    return i;
 	}
     }
 
@@ -65,5 +56,27 @@ XftColor *ColorGetXftColor(const char *name)
     }
     xft_color_table[num_xft_colors].name = GC_STRDUP(name);
     XftColorAllocName(disp, visual, colormap, name, &xft_color_table[num_xft_colors].color);
-    return &xft_color_table[num_xft_colors++].color;
+    return num_xft_colors++;
+}
+
+unsigned long ColorPixel(ColorHandle color)
+{
+    assert(color < num_xft_colors);
+    return xft_color_table[color].color.pixel;
+}
+
+XftColor *ColorXftColor(ColorHandle color)
+{
+    assert(color < num_xft_colors);
+    return &xft_color_table[color].color;
+}
+
+unsigned long ColorGetPixel(const char *name)
+{
+    return ColorPixel(ColorIntern(name));
+}
+
+XftColor *ColorGetXftColor(const char *name)
+{
+    return ColorXftColor(ColorIntern(name));
 }
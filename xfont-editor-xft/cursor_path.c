@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "cursor_path.h"
 
 bool CursorPathEquals(CursorPath a, CursorPath b)
@@ -8,36 +10,38 @@ bool CursorPathEquals(CursorPath a, CursorPath b)
 	    a.character == b.character);
 }
 
+// path の指すトークンの文書全体での番号。
+static size_t TokenIndex(Document *doc, CursorPath path)
+{
+    size_t tok = LineBegin(doc, path.line) + path.token;
+
+    assert(tok < LineEnd(doc, path.line));
+    return tok;
+}
+
 CursorPath ToCursorPath(Document *doc, size_t offset)
 {
-    size_t count = 0;
-
-    for (int i = 0; i < doc->nlines; i++) {
-	for (int j = 0; j < doc->lines[i].ntokens; j++) {
-	    for (int k = 0; k < doc->lines[i].tokens[j].nchars; k++) {
-		if (count == offset) {
-		    return (CursorPath) { .line = i, .token = j, .character = k };
-		}
-		count++;
-	    }
-	}
+    if (offset >= doc->nchars) {
+	fprintf(stderr, "ToCursorPath: out of range\n");
+	abort();
     }
-    fprintf(stderr, "ToCursorPath: out of range\n");
-    abort();
+
+    size_t tok = DocumentFindToken(doc, offset);
+    DocumentEnsureToken(doc, tok);
+    size_t line = DocumentFindLine(doc, tok);
+    return (CursorPath) {
+	.line = line,
+	.token = tok - LineBegin(doc, line),
+	.character = offset - TokenBegin(doc, tok)
+    };
 }
 
 size_t CursorPathToCharacterOffset(Document *doc, CursorPath path)
 {
-    
-    size_t count = 0;
+    size_t offset = TokenBegin(doc, TokenIndex(doc, path)) + path.character;
 
-    for (CursorPath it = { 0, 0, 0 };
-	 !CharacterIsEOF(CursorPathGetCharacter(doc, it)) && !CursorPathEquals(it, path)
-	 ; it = CursorPathForward(doc, it)) {
-	count++;
-    }
-
-    return count;
+    assert(offset < TokenEnd(doc, TokenIndex(doc, path)));
+    return offset;
 }
 
 CursorPath CursorPathForward(Document *doc, CursorPath path)
@@ -45,15 +49,14 @@ CursorPath CursorPathForward(Document *doc, CursorPath path)
     if (CursorPathIsEnd(doc, path)) {
 	return path;
     } else {
-	Token *tok = GetToken(doc, path.line, path.token);
-	VisualLine *line = GetLine(doc, path.line);
-	if (path.character < tok->nchars - 1) {
+	size_t tok = TokenIndex(doc, path);
+	if (TokenBegin(doc, tok) + path.character + 1 < TokenEnd(doc, tok)) {
 	    return (CursorPath) { path.line, path.token, path.character + 1 };
-	} else if (path.token < line->ntokens - 1) {
+	} else if (tok + 1 < LineEnd(doc, path.line)) {
 	    return (CursorPath) { path.line, path.token + 1, 0 };
 	} else {
 	    // 非最終行の行末に居る。
-
+	    DocumentEnsureLine(doc, path.line + 1);
 	    return (CursorPath) { path.line + 1, 0, 0 };
 	}
     }
@@ -66,22 +69,9 @@ bool CursorPathIsBegin(CursorPath path)
 
 bool CursorPathIsEnd(Document *doc, CursorPath path)
 {
-    return TokenIsEOF(GetToken(doc, path.line, path.token));
+    return TokenIsEOF(doc, TokenIndex(doc, path));
 }
 
-Character *CursorPathGetCharacter(Document *doc, CursorPath path)
-{
-    return GetCharacter(doc, path.line, path.token, path.character);
-}
-
-Character *GetCharacter(Document *doc, size_t line, size_t token, size_t character)
-{
-    Token *tok = GetToken(doc, line, token);
-    assert(character < tok->nchars);
-    return &tok->chars[character];
-}
-
-
 CursorPath CursorPathBackward(Document *doc, CursorPath path)
 {
     if (CursorPathIsBegin(path)) {
@@ -90,19 +80,52 @@ CursorPath CursorPathBackward(Document *doc, CursorPath path)
 	if (path.character > 0) {
 	    return (CursorPath) { path.line, path.token, path.character - 1 };
 	} else if (path.token > 0) {
-	    Token *tok = GetToken(doc, path.line, path.token - 1);
-	    return (CursorPath) { path.line, path.token - 1, tok->nchars - 1 };
+	    size_t tok = TokenIndex(doc, path) - 1;
+	    return (CursorPath) { path.line, path.token - 1, TokenEnd(doc, tok) - TokenBegin(doc, tok) - 1 };
 	} else {
 	    assert(path.line > 0);
 
-	    VisualLine *line = GetLine(doc, path.line - 1);
-	    Token *tok = GetToken(doc, path.line - 1, line->ntokens - 1);
-	    return (CursorPath) { path.line - 1, line->ntokens - 1, tok->nchars - 1};
+	    size_t line = path.line - 1;
+	    size_t tok = LineEnd(doc, line) - 1;
+	    return (CursorPath) { line, tok - LineBegin(doc, line), TokenEnd(doc, tok) - TokenBegin(doc, tok) - 1 };
 	}
     }
 }
 
 short CursorPathGetX(Document *doc, CursorPath path)
 {
-    return GetToken(doc, path.line, path.token)->x + CursorPathGetCharacter(doc, path)->x;
+    return doc->token_xs[TokenSlot(doc, TokenIndex(doc, path))] +
+	doc->xs[CharacterSlot(doc, CursorPathToCharacterOffset(doc, path))];
+}
+
+// 行の中では、トークンの位置も、トークンの中の文字の位置も増えていく
+// ので、それぞれ二分探索で引ける。
+CursorPath CursorPathAtX(Document *doc, size_t line, short x)
+{
+    size_t begin = LineBegin(doc, line);
+    size_t lo = begin, hi = LineEnd(doc, line);
+
+    // token_xs[tok] <= x となる最後のトークン。
+    while (hi - lo > 1) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (doc->token_xs[TokenSlot(doc, mid)] <= x)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    size_t tok = lo;
+
+    // トークンの文字は配列の上でも続けて並ぶ。
+    short dx = x - doc->token_xs[TokenSlot(doc, tok)];
+    const short *xs = doc->xs + (CharacterSlot(doc, TokenBegin(doc, tok)) - TokenBegin(doc, tok));
+    lo = TokenBegin(doc, tok);
+    hi = TokenEnd(doc, tok);
+    while (hi - lo > 1) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (xs[mid] <= dx)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return (CursorPath) { line, tok - begin, lo - TokenBegin(doc, tok) };
 }
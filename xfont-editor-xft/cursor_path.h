@@ -4,6 +4,10 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+// 行の番号、行の中でのトークンの番号、トークンの中での文字の番号。
+//
+//   文字の位置への変換は token_starts と line_starts を引くだけなので
+//   O(1)。文字の位置からの変換は、それらを二分探索するので O(log n)。
 typedef struct {
     size_t line;
     size_t token;
@@ -12,15 +16,16 @@ typedef struct {
 
 #include "document.h"
 
+// 行 line の中で、左端からの位置が x を超えない最後の位置を返す。無け
+// れば行頭を返す。
+CursorPath CursorPathAtX(Document *doc, size_t line, short x);
 CursorPath CursorPathBackward(Document *doc, CursorPath path);
 bool CursorPathEquals(CursorPath a, CursorPath b);
 CursorPath CursorPathForward(Document *doc, CursorPath path);
-Character *CursorPathGetCharacter(Document *doc, CursorPath path);
 short CursorPathGetX(Document *doc, CursorPath path);
 bool CursorPathIsBegin(CursorPath path);
 bool CursorPathIsEnd(Document *doc, CursorPath path);
 size_t CursorPathToCharacterOffset(Document *doc, CursorPath path);
-Character *GetCharacter(Document *doc, size_t line, size_t token, size_t character);
 CursorPath ToCursorPath(Document *doc, size_t offset);
 
 #endif
@@ -5,146 +5,266 @@
 #include <ctype.h>
 #include <alloca.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "util.h"
 #include "utf8-string.h"
+#include "char_class.h"
 #include "document.h"
 #include "hash.h"
 #include "font.h"
 #include "cursor_path.h"
+#include "word_cache.h"
 
 extern YFont *font;
-
-// EOF番兵文字のプロトタイプ
-static const Character EOF_CHARACTER =  {
-    .x = 0,
-    .width = 0,
-    .utf8 = "",
-    .length = 0
-};
+// NULL ならばキャッシュしない。
+extern WordCache *word_cache;
+
+// 1 文字のトークンは文字の寸法の表を引く方が速いのでキャッシュしな
+// い。長すぎるトークンもキャッシュしない。
+#define WORD_CACHE_MIN_CHARS 2
+#define WORD_CACHE_MAX_CHARS 64
+
+// 行を組むスレッドの数。1 以下ならば並列化しない。
+extern int layout_threads;
+// true ならば、最初は LAZY_LAYOUT_LINES 行だけを組み、残りは要るとき
+// に組む。
+extern bool lazy_layout;
+
+#define LAZY_LAYOUT_LINES 256
+// true ならば、段落ごとに Knuth と Plass の方法で最適な改行位置を求
+// める。false ならば、行に入るだけ詰める。
+extern bool optimal_fit;
+
+#define MAX_LAYOUT_THREADS 64
+// これより小さい文書は、スレッドを作る手間の方が大きい。
+#define LAYOUT_PARALLEL_MIN_TOKENS 16384
+#define LAYOUT_CHUNK_TOKENS 2048
 
 // ファイルローカルな関数の宣言。
-static void SetContextualCharacterWidths(VisualLine *line);
+static void SetContextualCharacterWidths(Document *doc, size_t begin, size_t end);
 static void MendDocument(Document *doc);
+static size_t ParagraphBegin(const Document *doc, size_t tok);
+static size_t ParagraphEnd(const Document *doc, size_t tok);
+
+static inline uint32_t CodePointAt(const Document *doc, size_t c)
+{
+    return doc->code_points[CharacterSlot(doc, c)];
+}
+
+// トークン tok の最初の文字。tok が ntokens ならば nchars を返す。隙間
+// の後ろは文書の終わりから数えてある。
+static inline size_t TokenStart(const Document *doc, size_t tok)
+{
+    if (tok < doc->token_gap)
+	return doc->token_starts[tok];
+    else
+	return doc->nchars - doc->token_starts[tok + doc->token_gap_length];
+}
+
+static inline size_t LineSlot(const Document *doc, size_t line)
+{
+    return (line < doc->line_gap) ? line : line + doc->line_gap_length;
+}
 
-bool TokenIsSpace(Token *tok)
+// 行 line の最初のトークン。line が nlines ならば組んでいない最初のト
+// ークンを返す。
+static inline size_t LineStart(const Document *doc, size_t line)
 {
-    return isspace(tok->chars[0].utf8[0]);
+    if (line < doc->line_gap)
+	return doc->line_starts[line];
+    else
+	return doc->ntokens - doc->line_starts[line + doc->line_gap_length];
 }
 
-bool TokenIsNewline(Token *tok)
+static inline void SetLineStart(Document *doc, size_t line, size_t tok)
 {
-    return tok->chars[0].utf8[0] == '\n';
+    if (line < doc->line_gap)
+	doc->line_starts[line] = tok;
+    else
+	doc->line_starts[line + doc->line_gap_length] = doc->ntokens - tok;
 }
 
-void CharacterInitialize(Character *ch, short x, const char *utf8, size_t bytes)
+size_t TokenBegin(const Document *doc, size_t tok)
 {
-    assert(bytes <= MAX_UTF8_CHAR_LENGTH);
-    memcpy(ch->utf8, utf8, bytes);
-    ch->utf8[bytes] = '\0';
-    ch->length = bytes;
-    ch->x = x;
+    assert(tok < doc->ntokens);
+    return TokenStart(doc, tok);
+}
 
-    ch->width = YFontTextWidth(font, ch->utf8, bytes);
+size_t TokenEnd(const Document *doc, size_t tok)
+{
+    assert(tok < doc->ntokens);
+    return TokenStart(doc, tok + 1);
 }
 
-Token *TokenCreate()
+size_t LineBegin(const Document *doc, size_t line)
 {
-    return GC_MALLOC(sizeof(Token));
+    assert(line < doc->nlines);
+    return LineStart(doc, line);
 }
 
-void TokenInitialize(Token *tok)
+size_t LineEnd(const Document *doc, size_t line)
 {
-    memset(tok, 0, sizeof(*tok));
+    assert(line < doc->nlines);
+    return LineStart(doc, line + 1);
 }
 
-short TokenEOF(Token *tok, short x)
+bool TokenIsSpace(const Document *doc, size_t tok)
 {
-    tok->x = x;
-    tok->nchars = 1;
-    tok->chars = GC_MALLOC(sizeof(Character));
+    uint32_t cp = CodePointAt(doc, TokenBegin(doc, tok));
 
-    CharacterInitialize(tok->chars, x - tok->x, "", 0);
-    return x;
+    return cp < 0x80 && isspace(cp);
 }
 
-bool CharacterIsEOF(Character *ch)
+bool TokenIsNewline(const Document *doc, size_t tok)
 {
-    return ch->length == 0;
+    return CodePointAt(doc, TokenBegin(doc, tok)) == '\n';
 }
 
-bool TokenIsEOF(Token *tok)
+bool CharacterIsEOF(const Document *doc, size_t c)
 {
-    return tok->nchars == 1 && CharacterIsEOF(tok->chars);
+    return c == doc->nchars - 1;
 }
 
-void InspectLine(VisualLine *line)
+bool TokenIsEOF(const Document *doc, size_t tok)
+{
+    return CharacterIsEOF(doc, TokenBegin(doc, tok));
+}
+
+void InspectLine(const Document *doc, size_t line)
 {
     printf("LINE[");
-    for (size_t i = 0; i < line->ntokens; i++) {
-	printf("%d, ", (int) line->tokens[i].width);
+    for (size_t t = LineBegin(doc, line); t < LineEnd(doc, line); t++) {
+	printf("%d, ", (int) doc->token_widths[TokenSlot(doc, t)]);
     }
     printf("]\n");
 }
 
-
-// ぶらさがり空白トークンを除いた、行の終端位置を示す Token ポインタを返す。
-// ぶらさがり空白トークンが無い場合は、デリファレンスできないので注意する。
-static Token *EffectiveLineEnd(VisualLine *line)
+// トークン [begin, end) からなる行について、ぶらさがり空白トークン
+// を除いた終端位置を示すトークンの番号を返す。ぶらさがり空白トークン
+// が無い場合は行の終わりになる。
+//
+// 行の単位の処理はトークンの範囲を受け取る。並列にレイアウトするとき
+// は、line_starts がまだできていないからである。
+static size_t EffectiveLineEnd(const Document *doc, size_t begin, size_t end)
 {
-    off_t index;
+    size_t t;
 
-    for (index = line->ntokens - 1; index >= 0; index--) {
-	if (!TokenIsSpace(&line->tokens[index])) {
+    for (t = end; t > begin; t--) {
+	if (!TokenIsSpace(doc, t - 1)) {
 	    break;
 	}
     }
-    return &line->tokens[index + 1];
+    return t;
 }
 
-static void MendToken(Token* tok)
+static void MendToken(Document *doc, size_t tok)
 {
+    // トークンの文字は続けて並ぶ。
+    size_t slot = CharacterSlot(doc, TokenBegin(doc, tok));
+    size_t nchars = TokenEnd(doc, tok) - TokenBegin(doc, tok);
     short x = 0;
-    for (Character *ch = tok->chars; ch < tok->chars + tok->nchars; ch++) {
-	ch->x = x;
-	x += ch->width;
+    for (size_t i = slot; i < slot + nchars; i++) {
+	doc->xs[i] = x;
+	x += doc->widths[i];
     }
-    tok->width = tok->chars[tok->nchars - 1].x + tok->chars[tok->nchars - 1].width;
+    doc->token_widths[TokenSlot(doc, tok)] = x;
 }
 
-// トークンの幅を元にトークンの x 座標を再計算する。
-void UpdateTokenPositions(VisualLine* line)
+static short CharacterNaturalWidth(const Document *doc, size_t c)
+{
+    uint32_t cp = CodePointAt(doc, c);
+
+    // NUL と EOF にはグリフが無い。
+    return (cp == 0) ? 0 : YFontCharWidth(font, cp);
+}
+
+// トークンの各文字の幅をフォントから求め、natural_widths と
+// natural_token_widths を設定する。同じ文字の並びのトークンは、キャッ
+// シュにある幅を使う。
+static void MeasureToken(Document *doc, size_t tok)
+{
+    size_t begin = TokenBegin(doc, tok);
+    size_t nchars = TokenEnd(doc, tok) - begin;
+    size_t slot = CharacterSlot(doc, begin);
+    short *widths = &doc->natural_widths[slot];
+
+    if (word_cache == NULL ||
+	nchars < WORD_CACHE_MIN_CHARS || nchars > WORD_CACHE_MAX_CHARS) {
+	for (size_t i = 0; i < nchars; i++)
+	    widths[i] = CharacterNaturalWidth(doc, begin + i);
+    } else {
+	// キーはフォントの番号に各文字の符号位置を続けたもの。
+	size_t bytes = sizeof(font->id) + sizeof(uint32_t) * nchars;
+	char key[bytes];
+	memcpy(key, &font->id, sizeof(font->id));
+	memcpy(key + sizeof(font->id), &doc->code_points[slot], sizeof(uint32_t) * nchars);
+
+	const short *cached = WordCacheGet(word_cache, (String) { key, bytes });
+	if (cached) {
+	    memcpy(widths, cached, sizeof(short) * nchars);
+	} else {
+	    for (size_t i = 0; i < nchars; i++)
+		widths[i] = CharacterNaturalWidth(doc, begin + i);
+	    WordCachePut(word_cache, (String) { key, bytes }, widths, nchars);
+	}
+    }
+
+    short width = 0;
+    for (size_t i = 0; i < nchars; i++)
+	width += widths[i];
+    doc->natural_token_widths[TokenSlot(doc, tok)] = width;
+}
+
+static void PositionTokens(Document *doc, size_t begin, size_t end)
 {
     short x = 0;
-    for (Token *tok = line->tokens; tok < line->tokens + line->ntokens; tok++) {
-	tok->x = x;
-	x += tok->width;
+    for (size_t t = begin; t < end; t++) {
+	doc->token_xs[TokenSlot(doc, t)] = x;
+	x += doc->token_widths[TokenSlot(doc, t)];
     }
 }
 
-// ragged right でフォーマットされた行を両端揃えにする。
-void JustifyLine(VisualLine *line, const PageInfo *page)
+// トークンの幅を元にトークンの x 座標を再計算する。
+void UpdateTokenPositions(Document *doc, size_t line)
 {
-    Token *trailing_space_start; // 仮想の行末。残りの空白は右マージンに被せる。
+    PositionTokens(doc, LineBegin(doc, line), LineEnd(doc, line));
+}
 
-    trailing_space_start = EffectiveLineEnd(line);
+// 幅を広げてよい空白トークンか。タブは広げない。
+static bool TokenIsStretchable(const Document *doc, size_t tok)
+{
+    return CodePointAt(doc, TokenBegin(doc, tok)) == ' ';
+}
+
+// ragged right でフォーマットされた、トークン [begin, end) からなる
+// 行を両端揃えにする。
+static void JustifyTokens(Document *doc, size_t begin, size_t end)
+{
+    const PageInfo *page = doc->page;
+    size_t trailing_space_start; // 仮想の行末。残りの空白は右マージンに被せる。
+
+    trailing_space_start = EffectiveLineEnd(doc, begin, end);
 
     // この行に空白しか無い場合は何もしない。
-    if (trailing_space_start == line->tokens)
+    if (trailing_space_start == begin)
 	return;
 
     int nspaces = 0;
-    for (Token *tok = line->tokens; tok < trailing_space_start; tok++)
-	if (tok->chars[0].utf8[0] == ' ')
+    for (size_t t = begin; t < trailing_space_start; t++)
+	if (TokenIsStretchable(doc, t))
 	    nspaces++;
 
+    // 最後の空白でないトークン。
+    size_t last_token = trailing_space_start - 1;
+    short right_edge = doc->token_xs[TokenSlot(doc, last_token)] + doc->token_widths[TokenSlot(doc, last_token)];
+    short shortage;
+
     // 空白トークンが無いので、その幅も調整できない。
     if (nspaces == 0)
 	goto Tracking;
 
-    // 最後の空白でないトークン。
-    Token *last_token = trailing_space_start - 1;
-    short right_edge = last_token->x + last_token->width;
     // printf("%hd vs %hd\n", PageInfoGetVisibleWidth(page), right_edge);
     // assert(PageInfoGetVisibleWidth(page) >= right_edge);
     if (PageInfoGetVisibleWidth(page) <= right_edge)
@@ -152,35 +272,34 @@ void JustifyLine(VisualLine *line, const PageInfo *page)
 
     // それぞれの空白トークンについて、増やすべき幅を計算する。
     int *addends = alloca(nspaces * sizeof(int));
-    short shortage = PageInfoGetVisibleWidth(page) - right_edge;
+    shortage = PageInfoGetVisibleWidth(page) - right_edge;
     Distribute(shortage, nspaces, addends);
 
     // ぶらさがっていない空白トークンに幅を分配する。
     int i = 0;
-    int SPACE_STRETCH_LIMIT = YFontTextWidth(font, " ", 1) * 3;
-    for (Token *tok = line->tokens; tok != trailing_space_start; tok++) {
-	if (TokenIsSpace(tok)) {
+    int SPACE_STRETCH_LIMIT = font->metrics.space_width * 3;
+    for (size_t t = begin; t != trailing_space_start; t++) {
+	if (TokenIsStretchable(doc, t)) {
 	    int addend = (addends[i] > SPACE_STRETCH_LIMIT) ? SPACE_STRETCH_LIMIT : addends[i];
 
-	    tok->width += addend;
+	    doc->token_widths[TokenSlot(doc, t)] += addend;
 	    i++;
 	}
     }
 
-    UpdateTokenPositions(line);
+    PositionTokens(doc, begin, end);
 
  Tracking:
-    last_token = trailing_space_start - 1;
-    right_edge = last_token->x + last_token->width;
+    right_edge = doc->token_xs[TokenSlot(doc, last_token)] + doc->token_widths[TokenSlot(doc, last_token)];
     shortage = PageInfoGetVisibleWidth(page) - right_edge;
-    size_t ntokens = trailing_space_start - line->tokens - 1;
+    size_t ntokens = trailing_space_start - begin - 1;
 
     if (ntokens == 0) {
 	// 最初のトークンが最後の可視トークンである場合。
 	return;
     }
 
-    short MAX_TRACK_DELTA = (short) (YFontEm(font) / 8.0);
+    short MAX_TRACK_DELTA = (short) (font->metrics.em / 8.0);
 
     if (shortage == 0) {
 	return;
@@ -189,7 +308,7 @@ void JustifyLine(VisualLine *line, const PageInfo *page)
 	Distribute(shortage, ntokens, addends);
 
 	for (int i = 0; i < ntokens; i++) {
-	    line->tokens[i].width += addends[i] > MAX_TRACK_DELTA ? MAX_TRACK_DELTA : addends[i];
+	    doc->token_widths[TokenSlot(doc, begin + i)] += addends[i] > MAX_TRACK_DELTA ? MAX_TRACK_DELTA : addends[i];
 	}
     } else {
 	short excess = -shortage;
@@ -197,133 +316,132 @@ void JustifyLine(VisualLine *line, const PageInfo *page)
 	Distribute(excess, ntokens, subtrahends);
 
 	for (int i = 0; i < ntokens; i++) {
-	    line->tokens[i].width -= subtrahends[i] > MAX_TRACK_DELTA ? MAX_TRACK_DELTA : subtrahends[i];
+	    doc->token_widths[TokenSlot(doc, begin + i)] -= subtrahends[i] > MAX_TRACK_DELTA ? MAX_TRACK_DELTA : subtrahends[i];
 	}
     }
-    UpdateTokenPositions(line);
+    PositionTokens(doc, begin, end);
 }
 
-// 文字列を Character レコードの配列に変換する。
-// 個々の Character の x 座標は 0 に設定される。
-Character *StringToCharacters(const char *text, size_t length, size_t *nchars_return)
+// ragged right でフォーマットされた行を両端揃えにする。
+void JustifyLine(Document *doc, size_t line)
 {
-    const char *p;
-    // 上限値で確保する。
-    Character *ret = GC_MALLOC(sizeof(Character) * (length + 1));
-    Character *q = ret;
+    JustifyTokens(doc, LineBegin(doc, line), LineEnd(doc, line));
+}
 
-    printf("StringToCharacters... %d bytes\n", (int) length);
-    for (p = text; p < text + length; p = Utf8AdvanceChar(p)) {
-	CharacterInitialize(q++, 0, p, Utf8CharBytes(p));
+// text を符号位置に変換して q から書き、書き終えた後ろを返す。不正
+// なバイトは 1 バイトずつ U+FFFD になる。
+static uint32_t *DecodeCharacters(const char *text, size_t length, uint32_t *q)
+{
+    for (const char *p = text; p < text + length; ) {
+	size_t bytes = Utf8CharBytes(p);
+	// 末尾で途切れた文字の先を読まない。
+	if (bytes > (size_t) (text + length - p))
+	    bytes = 1;
+
+	size_t decoded_bytes;
+	int32_t cp = Utf8DecodeChar(p, bytes, &decoded_bytes);
+	*q++ = (cp >= 0 && decoded_bytes == bytes) ? (uint32_t) cp : 0xfffd;
+	p += bytes;
+    }
+    return q;
+}
+
+// 文字列を符号位置の配列に変換する。最後に EOF の番兵を置く。
+uint32_t *StringToCharacters(const char *text, size_t length, size_t *nchars_return)
+{
+    size_t nchars, error_offset;
+    size_t capacity;
+
+    if (Utf8Validate(text, length, &nchars, &error_offset)) {
+	capacity = nchars + 1;
+    } else {
+	fprintf(stderr, "warning: invalid UTF-8 at byte offset %zu\n", error_offset);
+	// 上限値で確保する。
+	capacity = length + 1;
     }
-    *q++ = EOF_CHARACTER;
+    uint32_t *ret = GC_MALLOC_ATOMIC(sizeof(uint32_t) * capacity);
+    uint32_t *q = ret;
+
+    printf("StringToCharacters... %d bytes\n", (int) length);
+    // 後で文字の幅を求めるときに表を引くだけで済むようにする。
+    YFontPrefetch(font, text, length);
+    q = DecodeCharacters(text, length, q);
+    *q++ = 0; // EOF
     *nchars_return = q - ret;
-    // 無駄な部分を解放する。
-    ret = GC_REALLOC(ret, sizeof(Character) * (q - ret));
+    if ((size_t) (q - ret) < capacity) {
+	// 無駄な部分を解放する。
+	ret = GC_REALLOC(ret, sizeof(uint32_t) * (q - ret));
+    }
     puts("Done");
 
     return ret;
 }
 
-void TokenAddCharacter(Token *tok, Character *ch)
+static bool IsWordCharacter(uint32_t cp)
 {
-    assert (ch != NULL);
-
-    tok->chars = GC_REALLOC(tok->chars, (tok->nchars + 1) * sizeof(Character));
-    tok->chars[tok->nchars] = *ch;
-
-    tok->chars[tok->nchars].x = tok->width;
-    tok->width += ch->width;
-    tok->nchars++;
+    return CharClassOf(cp) & CHAR_WORD;
 }
 
-static Character *Tokenize(Character *ch, Token *tok)
+// 文字 c から始まるトークンの終わりを返す。
+static size_t Tokenize(const Document *doc, size_t c)
 {
-    assert( ch != NULL );
-    TokenInitialize(tok);
-
-    while (IsForbiddenAtEnd(ch->utf8)) {
-	TokenAddCharacter(tok, ch);
-	ch++;
+    // トークンは段落を越えず、段落の文字は続けて並ぶので、c の段落の
+    // 中は cps で引ける。
+    const uint32_t *cps = doc->code_points + (CharacterSlot(doc, c) - c);
+    size_t start = c;
+
+    // NUL と EOF はどのクラスにも属さない。
+    while (CharClassOf(cps[c]) & CHAR_FORBIDDEN_AT_END) {
+	c++;
     }
 
-    if (streq(ch->utf8, " ")) {
+    if (cps[c] == ' ') {
 	do {
-	    TokenAddCharacter(tok, ch);
-	    ch++;
-	} while (streq(ch->utf8, " "));
+	    c++;
+	} while (cps[c] == ' ');
 	goto End;
-    } else if (CTypeOf(ch->utf8, isalnum) ||
-	       streq(ch->utf8, "\'") ||
-	       streq(ch->utf8, ".") ||
-	       streq(ch->utf8, ",")) {
+    } else if (IsWordCharacter(cps[c])) {
 	do {
-	    TokenAddCharacter(tok, ch);
-	    ch++;
-	} while (CTypeOf(ch->utf8, isalnum) ||
-		 streq(ch->utf8, "\'") ||
-		 streq(ch->utf8, ".") ||
-		 streq(ch->utf8, ","));
+	    c++;
+	} while (IsWordCharacter(cps[c]));
     } else {
-	if (CharacterIsEOF(ch) || streq(ch->utf8, "\n")) {
-	    if (tok->nchars == 0) {  // EOF と NL は前の行頭禁止文字に連結しない。
-		TokenAddCharacter(tok, ch);
-		ch++;
+	if (CharacterIsEOF(doc, c) || cps[c] == '\n') {
+	    if (c == start) {  // EOF と NL は前の行頭禁止文字に連結しない。
+		c++;
 	    }
 	    goto End;
 	} else {
-	    TokenAddCharacter(tok, ch);
-	    ch++;
+	    c++;
 	}
     }
 
     // 行頭禁止文字が続いていたら連結する。
-    while (IsForbiddenAtStart(ch->utf8)) {
-	TokenAddCharacter(tok, ch);
-	ch++;
+    while (CharClassOf(cps[c]) & CHAR_FORBIDDEN_AT_START) {
+	c++;
     }
 
  End:
-    return ch;
+    return c;
 }
 
-Token *CharactersToTokens(Character text[], size_t nchars, size_t *ntokens_return)
+// 文書の文字をトークンに区切り、token_starts を設定する。
+static void CharactersToTokens(Document *doc)
 {
-    assert(text != NULL);
-
     puts("CharactersToTokens...");
     // nchars がトークン数の上限である。
-    Token *res = GC_MALLOC(sizeof(Token) * nchars);
+    uint32_t *starts = GC_MALLOC_ATOMIC(sizeof(uint32_t) * (doc->nchars + 1));
     size_t ntokens = 0;
-    Character *p = text;
+    size_t c = 0;
 
-    while (p < text + nchars) {
-	p = Tokenize(p, &res[ntokens++]);
+    while (c < doc->nchars) {
+	starts[ntokens++] = c;
+	c = Tokenize(doc, c);
     }
+    starts[ntokens] = doc->nchars;
     puts("Done");
-    res = GC_REALLOC(res, sizeof(Token) * ntokens);
 
-    *ntokens_return = ntokens;
-    return res;
-}
-
-void VisualLineAddToken(VisualLine *line, Token *tok)
-{
-    assert (tok != NULL);
-
-    line->tokens = GC_REALLOC(line->tokens, (line->ntokens + 1) * sizeof(Token));
-    line->tokens[line->ntokens] = *tok;
-
-    short x = 0;
-    if (line->ntokens > 0) {
-	x = line->tokens[line->ntokens - 1].x + line->tokens[line->ntokens - 1].width;
-    }
-    line->tokens[line->ntokens].x = x;
-    if (line->tokens[line->ntokens].chars[0].utf8[0] == '\t') {
-	short tab_width = YFontTextWidth(font, " ", 1) * 8; 
-	line->tokens[line->ntokens].width = (x / tab_width + 1) * tab_width - x;
-    }
-    line->ntokens++;
+    doc->token_starts = GC_REALLOC(starts, sizeof(uint32_t) * (ntokens + 1));
+    doc->ntokens = ntokens;
 }
 
 short PageInfoGetVisibleWidth(const PageInfo *page)
@@ -331,54 +449,327 @@ short PageInfoGetVisibleWidth(const PageInfo *page)
     return page->margin_right - page->margin_left;
 }
 
-VisualLine *VisualLineCreate()
+short LineGetWidth(const Document *doc, size_t line)
 {
-    return GC_MALLOC(sizeof(VisualLine));
-}
-
-short VisualLineGetWidth(VisualLine *line)
-{
-    if (line->ntokens == 0)
+    if (LineBegin(doc, line) == LineEnd(doc, line))
 	return 0;
     else
-	return line->tokens[line->ntokens - 1].x + line->tokens[line->ntokens - 1].width;
+	return doc->token_xs[TokenSlot(doc, LineEnd(doc, line) - 1)] + doc->token_widths[TokenSlot(doc, LineEnd(doc, line) - 1)];
 }
 
-Token *FillLine(VisualLine **line_return, Token *input, const PageInfo *page)
+// 行の左端から x の位置に置いたときのトークン tok の幅。タブは次の
+// タブ位置まで伸ばす。
+static short TokenWidthAt(const Document *doc, size_t tok, short x)
 {
-    assert (input != NULL);
+    if (CodePointAt(doc, TokenBegin(doc, tok)) == '\t') {
+	short tab_width = font->metrics.space_width * 8;
+	return (x / tab_width + 1) * tab_width - x;
+    }
+    return doc->natural_token_widths[TokenSlot(doc, tok)];
+}
 
-    short visible_width = PageInfoGetVisibleWidth(page);
-    VisualLine *line = VisualLineCreate();
+// トークン tok から始まる行に入るだけトークンを並べたときの、次の行
+// の最初のトークンを返す。文書は変えない。
+static size_t GreedyLineEnd(const Document *doc, size_t tok)
+{
+    short visible_width = PageInfoGetVisibleWidth(doc->page);
+    size_t first = tok;
+    short x = 0; // 行の幅。
 
     while (1) {
-	if (!(line->ntokens == 0 || TokenIsSpace(input))) {
-	    bool line_is_full = VisualLineGetWidth(line) + input->width > visible_width + (short) (YFontEm(font) * 0.75);
+	if (!(tok == first || TokenIsSpace(doc, tok))) {
+	    bool line_is_full = x + doc->natural_token_widths[TokenSlot(doc, tok)] > visible_width + (short) (font->metrics.em * 0.75);
 	    if (line_is_full) {
 		// このトークンの追加をキャンセルする。
 		break;
 	    }
 	}
-	VisualLineAddToken(line, input);
-	if (TokenIsEOF(input) || TokenIsNewline(input)) {
-	    input++;
+	x += TokenWidthAt(doc, tok, x);
+
+	if (TokenIsEOF(doc, tok) || TokenIsNewline(doc, tok)) {
+	    tok++;
 	    break;
 	} else {
-	    input++;
+	    tok++;
 	}
-    } 
+    }
 
     // 行の完成。
-    *line_return = line;
-    return input;
+    return tok;
+}
+
+// トークン [begin, end) を一行に並べる。
+static void PlaceTokens(Document *doc, size_t begin, size_t end)
+{
+    short x = 0;
+
+    for (size_t t = begin; t < end; t++) {
+	short width = TokenWidthAt(doc, t, x);
+	doc->token_xs[TokenSlot(doc, t)] = x;
+	doc->token_widths[TokenSlot(doc, t)] = width;
+	x += width;
+    }
 }
 
-static bool LastLineOfParagraph(VisualLine *line)
+// トークン tok から始まる行に入るだけトークンを並べ、次の行の最初の
+// トークンを返す。
+static size_t FillLine(Document *doc, size_t tok)
 {
-    assert(line->ntokens > 0);
-    Token *last_token = &line->tokens[line->ntokens-1];
-    
-    return TokenIsNewline(last_token) || TokenIsEOF(last_token);
+    size_t end = GreedyLineEnd(doc, tok);
+
+    PlaceTokens(doc, tok, end);
+    return end;
+}
+
+// 段落の改行位置の計画。starts[0] から starts[nstarts - 1] までが、段
+// 落の中の行の頭と段落の終わりである。
+//
+//   計画を立てるための作業領域も持ち、段落をまたいで使い回す。並列に
+//   組むワーカーは GC のヒープから確保できないので、on_gc_heap が
+//   false の計画は malloc で確保し、BreakPlanRelease で解放する。
+struct BreakPlan {
+    bool on_gc_heap;
+    uint32_t *starts;
+    size_t nstarts;
+    // 作業領域の要素数。
+    size_t capacity;
+    // 段落の頭からの位置 i についての配列。width と nstretchable は
+    // トークン [0, i) の自然な幅と広げられる空白の数の累積和。hang は
+    // i の前に続く空白トークンの始まり。demerits と prev は、i で改行
+    // するときの最小の減点と、その前の改行位置。
+    int32_t *width;
+    uint32_t *nstretchable;
+    uint32_t *hang;
+    int64_t *demerits;
+    uint32_t *prev;
+    // 行の頭になり得る、まだ見込みのある位置。昇順。
+    uint32_t *active;
+};
+
+// 行の減点の基本値。行を少なくする方へ働く。
+#define LINE_PENALTY 10
+// これより悪い行は、どれも同じだけ悪いものとする。
+#define MAX_BADNESS 10000
+
+static BreakPlan *BreakPlanCreate(void)
+{
+    BreakPlan *plan = GC_MALLOC(sizeof(BreakPlan));
+
+    plan->on_gc_heap = true;
+    return plan;
+}
+
+static void *BreakPlanRealloc(const BreakPlan *plan, void *p, size_t bytes)
+{
+    if (plan->on_gc_heap)
+	return GC_REALLOC(p, bytes);
+
+    void *q = realloc(p, bytes);
+    if (q == NULL) {
+	fprintf(stderr, "BreakPlanRealloc: out of memory\n");
+	abort();
+    }
+    return q;
+}
+
+// malloc で確保した計画の領域を解放する。
+static void BreakPlanRelease(BreakPlan *plan)
+{
+    assert(!plan->on_gc_heap);
+    free(plan->starts);
+    free(plan->width);
+    free(plan->nstretchable);
+    free(plan->hang);
+    free(plan->demerits);
+    free(plan->prev);
+    free(plan->active);
+    *plan = (BreakPlan) { .on_gc_heap = false };
+}
+
+// 作業領域を n 要素以上にする。
+static void BreakPlanReserve(BreakPlan *plan, size_t n)
+{
+    if (n <= plan->capacity)
+	return;
+
+    size_t capacity = plan->capacity ? plan->capacity * 2 : 256;
+    while (capacity < n)
+	capacity *= 2;
+    plan->starts = BreakPlanRealloc(plan, plan->starts, sizeof(uint32_t) * capacity);
+    plan->width = BreakPlanRealloc(plan, plan->width, sizeof(int32_t) * capacity);
+    plan->nstretchable = BreakPlanRealloc(plan, plan->nstretchable, sizeof(uint32_t) * capacity);
+    plan->hang = BreakPlanRealloc(plan, plan->hang, sizeof(uint32_t) * capacity);
+    plan->demerits = BreakPlanRealloc(plan, plan->demerits, sizeof(int64_t) * capacity);
+    plan->prev = BreakPlanRealloc(plan, plan->prev, sizeof(uint32_t) * capacity);
+    plan->active = BreakPlanRealloc(plan, plan->active, sizeof(uint32_t) * capacity);
+    plan->capacity = capacity;
+}
+
+// 段落の中のトークン [begin, end) を、入るだけ詰めて改行する計画を立
+// てる。
+static void PlanGreedyBreaks(const Document *doc, BreakPlan *plan, size_t begin, size_t end)
+{
+    size_t n = 0;
+
+    for (size_t tok = begin; tok < end; tok = GreedyLineEnd(doc, tok))
+	plan->starts[n++] = tok;
+    plan->starts[n++] = end;
+    plan->nstarts = n;
+}
+
+// 段落の中のトークン [begin, end) の改行位置を Knuth と Plass の方法
+// で決める。箱はトークンで、空白のトークンは伸びる糊になる。空白で
+// ないトークンの前で改行でき、行末の空白はぶらさげる。JustifyTokens
+// と同じく、空白は SPACE_STRETCH_LIMIT まで伸び、トークンの間は em/8
+// まで伸び縮みするものとして、行の悪さを求める。
+//
+//   行の減点は前後の行に依らないので、位置ごとの最小の減点を前から順
+//   に求めればよい。縮めても入らなくなった行の頭は、それより先でも入
+//   らないので候補から外す。候補は一行に入るトークンの数ほどしか残ら
+//   ないので、段落の長さにほぼ比例する時間で済む。
+//
+//   タブの幅は行の中での位置で変わるので、タブを含む段落は入るだけ詰
+//   める。
+static void PlanOptimalBreaks(const Document *doc, BreakPlan *plan, size_t begin, size_t end)
+{
+    size_t n = end - begin;
+    BreakPlanReserve(plan, n + 1);
+
+    for (size_t t = begin; t < end; t++) {
+	if (CodePointAt(doc, TokenBegin(doc, t)) == '\t') {
+	    PlanGreedyBreaks(doc, plan, begin, end);
+	    return;
+	}
+    }
+
+    int32_t *width = plan->width;
+    uint32_t *nstretchable = plan->nstretchable;
+    uint32_t *hang = plan->hang;
+    width[0] = 0;
+    nstretchable[0] = 0;
+    hang[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+	width[i + 1] = width[i] + doc->natural_token_widths[TokenSlot(doc, begin + i)];
+	nstretchable[i + 1] = nstretchable[i] + TokenIsStretchable(doc, begin + i);
+	hang[i + 1] = TokenIsSpace(doc, begin + i) ? hang[i] : i + 1;
+    }
+
+    int visible_width = PageInfoGetVisibleWidth(doc->page);
+    int space_stretch = font->metrics.space_width * 3;
+    int track = (short) (font->metrics.em / 8.0);
+    int64_t *demerits = plan->demerits;
+    uint32_t *prev = plan->prev;
+    uint32_t *active = plan->active;
+    size_t nactive = 1;
+    active[0] = 0;
+    demerits[0] = 0;
+
+    // 最後のトークン (改行か EOF) の前では改行しない。
+    for (size_t e = 1; e <= n; e++) {
+	if (e < n && (e == n - 1 || TokenIsSpace(doc, begin + e)))
+	    continue;
+
+	int64_t best = INT64_MAX;
+	size_t kept = 0;
+	for (size_t k = 0; k < nactive; k++) {
+	    size_t b = active[k];
+	    size_t visible_end = (hang[e] > b) ? hang[e] : b;
+	    int ngaps = (visible_end > b) ? (int) (visible_end - b - 1) : 0;
+	    int shortage = visible_width - (width[visible_end] - width[b]);
+	    int badness;
+
+	    if (shortage + ngaps * track < 0) {
+		// 縮めても入らない。トークンが一つだけならば仕方が無い。
+		if (ngaps > 0)
+		    continue;
+		badness = MAX_BADNESS;
+	    } else if (e == n || shortage == 0) {
+		// 最後の行は両端揃えにしない。
+		badness = 0;
+	    } else {
+		int flex = (shortage > 0)
+		    ? (int) (nstretchable[visible_end] - nstretchable[b]) * space_stretch + ngaps * track
+		    : ngaps * track;
+		double ratio = (flex > 0) ? (double) abs(shortage) / flex : MAX_BADNESS;
+		double b3 = 100 * ratio * ratio * ratio;
+		badness = (b3 > MAX_BADNESS) ? MAX_BADNESS : (int) b3;
+	    }
+	    active[kept++] = b;
+
+	    int64_t d = demerits[b] + (int64_t) (LINE_PENALTY + badness) * (LINE_PENALTY + badness);
+	    if (d < best) {
+		best = d;
+		prev[e] = b;
+	    }
+	}
+	nactive = kept;
+
+	// 候補の頭が無くなるのは、前の行頭からトークン一つ分も進んでい
+	// ないときだけで、ここには来ない。
+	assert(best != INT64_MAX);
+	demerits[e] = best;
+	active[nactive++] = e;
+    }
+
+    // 段落の終わりからたどって、行の頭を並べる。
+    size_t nstarts = 1;
+    for (size_t i = n; i > 0; i = prev[i])
+	nstarts++;
+    plan->nstarts = nstarts;
+    for (size_t i = n; ; i = prev[i]) {
+	plan->starts[--nstarts] = begin + i;
+	if (i == 0)
+	    break;
+    }
+}
+
+// 計画の中で tok から始まる行の次の行の頭を返す。tok が計画に無けれ
+// ば 0 を返す。
+static size_t BreakPlanNext(const BreakPlan *plan, size_t tok)
+{
+    if (plan->nstarts < 2 || tok < plan->starts[0] || tok >= plan->starts[plan->nstarts - 1])
+	return 0;
+
+    size_t lo = 0, hi = plan->nstarts - 1;
+    while (hi - lo > 1) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (plan->starts[mid] <= tok)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return (plan->starts[lo] == tok) ? plan->starts[lo + 1] : 0;
+}
+
+// トークン tok から始まる行の、最適な改行位置を返す。段落ごとに計画
+// を立て、段落の残りの行はその計画を使う。
+static size_t OptimalLineEnd(Document *doc, BreakPlan *plan, size_t tok)
+{
+    size_t end = BreakPlanNext(plan, tok);
+
+    if (end == 0) {
+	// 段落の頭から立てれば、段落全体を一度に組んだときと同じになる。
+	// 前の行がこの計画に依らずに組まれていたら、tok から立てる。
+	size_t para_begin = ParagraphBegin(doc, tok);
+	size_t para_end = ParagraphEnd(doc, tok);
+	PlanOptimalBreaks(doc, plan, para_begin, para_end);
+	end = BreakPlanNext(plan, tok);
+	if (end == 0) {
+	    PlanOptimalBreaks(doc, plan, tok, para_end);
+	    end = BreakPlanNext(plan, tok);
+	}
+    }
+    PlaceTokens(doc, tok, end);
+    return end;
+}
+
+// トークン [begin, end) からなる行が段落の最後の行か。
+static bool LastLineOfParagraph(const Document *doc, size_t begin, size_t end)
+{
+    assert(end > begin);
+    size_t last_token = end - 1;
+
+    return TokenIsNewline(doc, last_token) || TokenIsEOF(doc, last_token);
 }
 
 static void InspectPageInfo(const PageInfo *page)
@@ -393,154 +784,1055 @@ static void InspectPageInfo(const PageInfo *page)
     printf(">\n");
 }
 
-static VisualLine *CreateLines(Token *tokens, size_t ntokens, const PageInfo *page, size_t *nlines_return)
+// 行の配列を、隙間も含めて少なくとも nlines 行分に広げる。
+static void ReserveLines(Document *doc, size_t nlines)
 {
-    VisualLine *lines = NULL;
+    if (nlines <= doc->line_capacity)
+	return;
+
+    size_t capacity = doc->line_capacity * 2;
+    while (capacity < nlines)
+	capacity *= 2;
+    doc->line_starts = ArenaGrow(doc->layout_arena, doc->line_starts,
+				 sizeof(uint32_t) * (doc->line_capacity + 1),
+				 sizeof(uint32_t) * (capacity + 1));
+    doc->line_capacity = capacity;
+}
+
+// トークン tok から始まる行を組み、次の行の最初のトークンを返す。書
+// き換えるのは行の中のトークンと文字の幅と位置、それに改行位置の計画
+// plan だけである。
+static size_t LayOutTokens(Document *doc, BreakPlan *plan, size_t tok)
+{
+    size_t end = optimal_fit ? OptimalLineEnd(doc, plan, tok) : FillLine(doc, tok);
+
+    SetContextualCharacterWidths(doc, tok, end);
+
+    if (!LastLineOfParagraph(doc, tok, end))
+	JustifyTokens(doc, tok, end);
+    return end;
+}
+
+// トークン tok から行 line を組み、次の行の最初のトークンを返す。行
+// line が最後の行になる。
+static size_t LayOutLine(Document *doc, size_t line, size_t tok)
+{
+    ReserveLines(doc, line + 1 + doc->line_gap_length);
+    SetLineStart(doc, line, tok);
+    tok = LayOutTokens(doc, doc->break_plan, tok);
+    SetLineStart(doc, line + 1, tok);
+    doc->nlines = line + 1;
+    return tok;
+}
+
+// 並列にレイアウトするときの仕事。チャンクは段落の区切りで分ける。
+typedef struct {
+    Document *doc;
+    // チャンク i はトークン [chunk_starts[i], chunk_starts[i + 1])。
+    const size_t *chunk_starts;
+    size_t nchunks;
+    // 次に取るチャンク。
+    atomic_size_t next_chunk;
+    // チャンクごとの行数。
+    size_t *chunk_nlines;
+} LayoutJob;
+
+// 残っているチャンクを一つずつ取ってレイアウトする。チャンクの行の区
+// 切りは、line_starts のそのチャンクの最初のトークンの番号の位置から
+// 書く。行数はトークン数を超えないので、隣のチャンクとは重ならない。
+//
+// ワーカーは GC のヒープから確保しないし、Xft も呼ばないので、GC に
+// スレッドを登録しなくてよい。
+static void *LayOutChunks(void *arg)
+{
+    LayoutJob *job = arg;
+    Document *doc = job->doc;
+    BreakPlan plan = { .on_gc_heap = false };
+    size_t i;
+
+    while ((i = atomic_fetch_add(&job->next_chunk, 1)) < job->nchunks) {
+	size_t tok = job->chunk_starts[i];
+	size_t end = job->chunk_starts[i + 1];
+	uint32_t *starts = &doc->line_starts[tok];
+	size_t nlines = 0;
+
+	while (tok < end) {
+	    starts[nlines++] = tok;
+	    tok = LayOutTokens(doc, &plan, tok);
+	}
+	job->chunk_nlines[i] = nlines;
+    }
+    BreakPlanRelease(&plan);
+    return NULL;
+}
+
+// layout_threads 個のスレッドで段落ごとに並列に行を組む。結果は逐次
+// に組んだものと同じになる。
+static void CreateLinesParallel(Document *doc)
+{
+    // 段落の区切りで、少なくとも LAYOUT_CHUNK_TOKENS 個のトークンを
+    // 含むチャンクに分ける。
+    size_t *chunk_starts = GC_MALLOC_ATOMIC(sizeof(size_t) * (doc->ntokens / LAYOUT_CHUNK_TOKENS + 2));
+    size_t nchunks = 0;
+
+    chunk_starts[0] = 0;
+    for (size_t t = 0; t < doc->ntokens; t++) {
+	if (TokenIsNewline(doc, t) && t + 1 - chunk_starts[nchunks] >= LAYOUT_CHUNK_TOKENS)
+	    chunk_starts[++nchunks] = t + 1;
+    }
+    if (chunk_starts[nchunks] < doc->ntokens)
+	chunk_starts[++nchunks] = doc->ntokens;
+
+    LayoutJob job = {
+	.doc = doc,
+	.chunk_starts = chunk_starts,
+	.nchunks = nchunks,
+	.chunk_nlines = GC_MALLOC_ATOMIC(sizeof(size_t) * nchunks),
+    };
+    atomic_init(&job.next_chunk, 0);
+
+    // どのチャンクの行も、そのチャンクの位置に書けるようにする。
+    ReserveLines(doc, doc->ntokens);
+
+    // このスレッドも働く。作れなかったスレッドの分は、残りのスレッド
+    // がこなす。
+    pthread_t threads[MAX_LAYOUT_THREADS];
+    int nthreads = 0;
+    for (int i = 1; i < layout_threads && i < MAX_LAYOUT_THREADS; i++) {
+	if (pthread_create(&threads[nthreads], NULL, LayOutChunks, &job) == 0)
+	    nthreads++;
+    }
+    LayOutChunks(&job);
+    for (int i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+
+    // チャンクごとの行を前に詰める。
     size_t nlines = 0;
-    Token *tok = tokens;
+    for (size_t i = 0; i < nchunks; i++) {
+	memmove(&doc->line_starts[nlines], &doc->line_starts[chunk_starts[i]],
+		sizeof(uint32_t) * job.chunk_nlines[i]);
+	nlines += job.chunk_nlines[i];
+    }
+    doc->line_starts[nlines] = doc->ntokens;
+    doc->nlines = nlines;
+}
+
+static void CreateLines(Document *doc)
+{
+    // 前のレイアウトの領域を再利用する。
+    ArenaReset(doc->layout_arena);
+
+    doc->line_capacity = 64;
+    doc->line_starts = ArenaAlloc(doc->layout_arena, sizeof(uint32_t) * (doc->line_capacity + 1));
+    doc->line_gap = SIZE_MAX;
+    doc->line_gap_length = 0;
+    doc->break_plan->nstarts = 0;
+
+    // InspectPageInfo(doc->page);
+    if (!lazy_layout && layout_threads > 1 && doc->ntokens >= LAYOUT_PARALLEL_MIN_TOKENS) {
+	CreateLinesParallel(doc);
+	return;
+    }
 
-    // InspectPageInfo(page);
-    VisualLine *line;
+    size_t limit = lazy_layout ? LAZY_LAYOUT_LINES : SIZE_MAX;
+    size_t line = 0;
+    size_t tok = 0;
     do {
-	lines = GC_REALLOC(lines, (nlines + 1) * sizeof(VisualLine));
-	tok = FillLine(&line, tok, page);
+	tok = LayOutLine(doc, line++, tok);
+    } while (tok < doc->ntokens && line < limit);
+}
 
-	SetContextualCharacterWidths(line);
+// 全てのトークンを行に組んであるか。
+bool DocumentIsLaidOut(const Document *doc)
+{
+    return LineStart(doc, doc->nlines) == doc->ntokens;
+}
 
- 	if (!LastLineOfParagraph(line))
-	JustifyLine(line, page);
+// まだ組んでいない行を最大 nlines 行組む。まだ残っていれば true を返
+// す。
+bool DocumentLayOutMore(Document *doc, size_t nlines)
+{
+    for (size_t i = 0; i < nlines && !DocumentIsLaidOut(doc); i++)
+	LayOutLine(doc, doc->nlines, LineStart(doc, doc->nlines));
+    return !DocumentIsLaidOut(doc);
+}
 
-	lines[nlines] = *line;
-	nlines++;
-    } while (tok < tokens + ntokens);
+// 行 line まで組む。文書にその行が無ければ false を返す。
+bool DocumentEnsureLine(Document *doc, size_t line)
+{
+    while (line >= doc->nlines && !DocumentIsLaidOut(doc))
+	LayOutLine(doc, doc->nlines, LineStart(doc, doc->nlines));
+    return line < doc->nlines;
+}
 
-    *nlines_return = nlines;
-    return lines;
+// トークン tok を含む行まで組む。
+void DocumentEnsureToken(Document *doc, size_t tok)
+{
+    assert(tok < doc->ntokens);
+
+    while (tok >= LineStart(doc, doc->nlines))
+	LayOutLine(doc, doc->nlines, LineStart(doc, doc->nlines));
 }
 
-static void SetContextualCharacterWidths(VisualLine *line)
+static void SetContextualCharacterWidths(Document *doc, size_t begin, size_t end)
 {
-    Token *last_visible_token = EffectiveLineEnd(line);
+    size_t last_visible_token = EffectiveLineEnd(doc, begin, end);
+
+    for (size_t t = begin; t < end; t++) {
+	bool last_token = t + 1 == last_visible_token;
 
-    for (int i = 0; i < line->ntokens; i++) {
-	bool last_token = (&line->tokens[i] + 1) == last_visible_token;
+	// トークンの文字は続けて並ぶ。
+	size_t first = CharacterSlot(doc, TokenBegin(doc, t));
+	size_t last = first + (TokenEnd(doc, t) - TokenBegin(doc, t)) - 1;
+	for (size_t i = first; i <= last; i++) {
+	    bool line_end = last_token && (i == last);
+	    bool line_beginning = (t == begin && i == first);
+	    uint32_t cp = doc->code_points[i];
 
-	for (int j = 0; j < line->tokens[i].nchars; j++) {
-	    bool line_end = last_token && (j == line->tokens[i].nchars - 1);
-	    bool line_beginning = (i == 0 && j == 0);
-	    Character *ch = &line->tokens[i].chars[j];
+	    doc->widths[i] = doc->natural_widths[i];
+	    unsigned int klass = CharClassOf(cp);
 
-	    if (Utf8IsAnyOf(ch->utf8, CC_OPEN_PAREN)) {
-		ch->width = (line_beginning) ? YFontEm(font) / 2 : YFontEm(font);
+	    if (klass & CHAR_OPEN_PAREN) {
+		doc->widths[i] = (line_beginning) ? font->metrics.em / 2 : font->metrics.em;
 	    }
-	    if (Utf8IsAnyOf(ch->utf8, CC_CLOSE_PAREN CC_PERIOD CC_COMMA)) {
-		ch->width = (line_end) ? YFontEm(font) / 2 : YFontEm(font);
+	    if (klass & (CHAR_CLOSE_PAREN | CHAR_PERIOD | CHAR_COMMA)) {
+		doc->widths[i] = (line_end) ? font->metrics.em / 2 : font->metrics.em;
 	    }
 	}
-	MendToken(&line->tokens[i]);
+	MendToken(doc, t);
     }
-    UpdateTokenPositions(line);
+    PositionTokens(doc, begin, end);
 }
 
-Token *ExtractTokens(Document *doc, size_t *ntokens_return)
+// ページの幅が変わったときは行分割からやり直せばよい。
+static void MendDocument(Document *doc)
 {
-    size_t ntokens = 0;
-    for (int i = 0; i < doc->nlines; i++) {
-	ntokens += doc->lines[i].ntokens;
+    CreateLines(doc);
+}
+
+// nchars 文字の符号位置 cps から文書を作る。cps は文書のものになる。
+static Document *CreateDocumentFromCharacters(uint32_t *cps, size_t nchars, const PageInfo *page)
+{
+    Document *doc = GC_MALLOC(sizeof(Document));
+
+    doc->code_points = cps;
+    doc->nchars = nchars;
+    // 隙間は最初に編集するときに作る。
+    doc->char_gap = SIZE_MAX;
+    doc->char_gap_length = 0;
+    doc->natural_widths = GC_MALLOC_ATOMIC(sizeof(short) * doc->nchars);
+    doc->widths = GC_MALLOC_ATOMIC(sizeof(short) * doc->nchars);
+    doc->xs = GC_MALLOC_ATOMIC(sizeof(short) * doc->nchars);
+
+    CharactersToTokens(doc);
+    doc->token_gap = SIZE_MAX;
+    doc->token_gap_length = 0;
+    doc->natural_token_widths = GC_MALLOC_ATOMIC(sizeof(short) * doc->ntokens);
+    doc->token_xs = GC_MALLOC_ATOMIC(sizeof(short) * doc->ntokens);
+    doc->token_widths = GC_MALLOC_ATOMIC(sizeof(short) * doc->ntokens);
+    // 一行に平均 16 トークンとして、行の配列が収まる大きさから始める。
+    doc->layout_arena = ArenaCreate(sizeof(uint32_t) * (doc->ntokens / 16 + 1));
+    doc->break_plan = BreakPlanCreate();
+
+    doc->page = GC_MALLOC(sizeof(PageInfo));
+    *doc->page = *page;
+
+    for (size_t t = 0; t < doc->ntokens; t++)
+	MeasureToken(doc, t);
+    CreateLines(doc);
+
+    return doc;
+}
+
+Document *CreateDocument(const char *text, size_t length, const PageInfo *page)
+{
+    size_t nchars;
+    uint32_t *cps = StringToCharacters(text, length, &nchars);
+
+    return CreateDocumentFromCharacters(cps, nchars, page);
+}
+
+// 文字 c を含むトークンの番号を返す。
+size_t DocumentFindToken(const Document *doc, size_t c)
+{
+    assert(c < doc->nchars);
+
+    // token_starts[lo] <= c < token_starts[hi] を保つ。
+    size_t lo = 0, hi = doc->ntokens;
+    while (hi - lo > 1) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (TokenStart(doc, mid) <= c)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+// トークン tok を含む行の番号を返す。
+size_t DocumentFindLine(const Document *doc, size_t tok)
+{
+    assert(tok < doc->ntokens);
+    // まだ組んでいない行は探せない。DocumentEnsureToken を先に呼ぶこと。
+    assert(tok < LineStart(doc, doc->nlines));
+
+    size_t lo = 0, hi = doc->nlines;
+    while (hi - lo > 1) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (LineStart(doc, mid) <= tok)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+void DocumentSetPageInfo(Document *doc, PageInfo *page)
+{
+    *doc->page = *page;
+    MendDocument(doc);
+}
+
+// 配列 array の count 個の要素のうち、gap の前に length 個分の隙間が
+// ある。隙間を要素 to の前へ動かす。gap が count を超えていれば隙間は
+// 末尾にある。
+static void MoveGap(void *array, size_t size, size_t count, size_t gap, size_t length, size_t to)
+{
+    char *p = array;
+
+    if (length == 0)
+	return;
+    if (gap > count)
+	gap = count;
+    if (to < gap)
+	memmove(p + size * (to + length), p + size * to, size * (gap - to));
+    else if (to > gap)
+	memmove(p + size * gap, p + size * (gap + length), size * (to - gap));
+}
+
+// 配列 array の count 個の要素のうち、gap の後ろにある length 個分の
+// 隙間を new_length 個分に広げる。
+static void *WidenGap(void *array, size_t size, size_t count, size_t gap, size_t length, size_t new_length)
+{
+    char *p = GC_REALLOC(array, size * (count + new_length));
+
+    if (gap > count)
+	gap = count;
+    memmove(p + size * (gap + new_length), p + size * (gap + length), size * (count - gap));
+    return p;
+}
+
+// 位置 array の [from, to) を、頭から数えるか total から引くかで読み
+// 替える。隙間の前後で数え方が違うので、隙間を越えた位置に使う。
+static void FlipPositions(uint32_t *array, size_t from, size_t to, size_t total)
+{
+    for (size_t i = from; i < to; i++)
+	array[i] = total - array[i];
+}
+
+// 文字の隙間を文字 to の前へ動かす。
+static void MoveCharacterGap(Document *doc, size_t to)
+{
+    size_t n = doc->nchars, gap = doc->char_gap, length = doc->char_gap_length;
+
+    MoveGap(doc->code_points, sizeof(uint32_t), n, gap, length, to);
+    MoveGap(doc->natural_widths, sizeof(short), n, gap, length, to);
+    MoveGap(doc->widths, sizeof(short), n, gap, length, to);
+    MoveGap(doc->xs, sizeof(short), n, gap, length, to);
+    doc->char_gap = to;
+}
+
+// トークンの隙間をトークン to の前へ動かす。隙間を越えたトークンの最
+// 初の文字は数え方を変える。
+static void MoveTokenGap(Document *doc, size_t to)
+{
+    size_t n = doc->ntokens, length = doc->token_gap_length;
+    size_t gap = (doc->token_gap < n + 1) ? doc->token_gap : n + 1;
+
+    if (to < gap) {
+	MoveGap(doc->token_starts, sizeof(uint32_t), n + 1, gap, length, to);
+	FlipPositions(doc->token_starts, to + length, gap + length, doc->nchars);
+    } else {
+	FlipPositions(doc->token_starts, gap + length, to + length, doc->nchars);
+	MoveGap(doc->token_starts, sizeof(uint32_t), n + 1, gap, length, to);
     }
+    MoveGap(doc->natural_token_widths, sizeof(short), n, gap, length, to);
+    MoveGap(doc->token_xs, sizeof(short), n, gap, length, to);
+    MoveGap(doc->token_widths, sizeof(short), n, gap, length, to);
+    doc->token_gap = to;
+}
+
+// 行の隙間を行 to の前へ動かす。隙間を越えた行の最初のトークンは数え
+// 方を変える。
+static void MoveLineGap(Document *doc, size_t to)
+{
+    size_t n = doc->nlines, length = doc->line_gap_length;
+    size_t gap = (doc->line_gap < n + 1) ? doc->line_gap : n + 1;
+
+    if (to < gap) {
+	MoveGap(doc->line_starts, sizeof(uint32_t), n + 1, gap, length, to);
+	FlipPositions(doc->line_starts, to + length, gap + length, doc->ntokens);
+    } else {
+	FlipPositions(doc->line_starts, gap + length, to + length, doc->ntokens);
+	MoveGap(doc->line_starts, sizeof(uint32_t), n + 1, gap, length, to);
+    }
+    doc->line_gap = to;
+}
+
+// 行の隙間を末尾へ動かして閉じる。区切りは全て頭から数えたものになる。
+static void CloseLineGap(Document *doc)
+{
+    MoveLineGap(doc, doc->nlines + 1);
+    doc->line_gap = SIZE_MAX;
+    doc->line_gap_length = 0;
+}
+
+// 文字の隙間を少なくとも n 文字分にする。配列は倍々に広げるので、広
+// げる手間は挿入した文字にならせば定数である。
+static void GrowCharacterGap(Document *doc, size_t n)
+{
+    if (n <= doc->char_gap_length)
+	return;
+
+    size_t count = doc->nchars, gap = doc->char_gap, length = doc->char_gap_length;
+    size_t capacity = (count + length) * 2;
+    while (capacity < count + n)
+	capacity *= 2;
+    size_t new_length = capacity - count;
+    doc->code_points = WidenGap(doc->code_points, sizeof(uint32_t), count, gap, length, new_length);
+    doc->natural_widths = WidenGap(doc->natural_widths, sizeof(short), count, gap, length, new_length);
+    doc->widths = WidenGap(doc->widths, sizeof(short), count, gap, length, new_length);
+    doc->xs = WidenGap(doc->xs, sizeof(short), count, gap, length, new_length);
+    doc->char_gap_length = new_length;
+}
+
+// トークンの隙間を少なくとも n 個分にする。
+static void GrowTokenGap(Document *doc, size_t n)
+{
+    if (n <= doc->token_gap_length)
+	return;
+
+    size_t count = doc->ntokens, gap = doc->token_gap, length = doc->token_gap_length;
+    size_t capacity = (count + length) * 2;
+    while (capacity < count + n)
+	capacity *= 2;
+    size_t new_length = capacity - count;
+    doc->token_starts = WidenGap(doc->token_starts, sizeof(uint32_t), count + 1, gap, length, new_length);
+    doc->natural_token_widths = WidenGap(doc->natural_token_widths, sizeof(short), count, gap, length, new_length);
+    doc->token_xs = WidenGap(doc->token_xs, sizeof(short), count, gap, length, new_length);
+    doc->token_widths = WidenGap(doc->token_widths, sizeof(short), count, gap, length, new_length);
+    doc->token_gap_length = new_length;
+}
+
+// トークン tok を含む段落の最初のトークンを返す。
+static size_t ParagraphBegin(const Document *doc, size_t tok)
+{
+    while (tok > 0 && !TokenIsNewline(doc, tok - 1))
+	tok--;
+    return tok;
+}
+
+// トークン tok を含む段落の終わり、つまり改行か EOF のトークンの次を
+// 返す。
+static size_t ParagraphEnd(const Document *doc, size_t tok)
+{
+    while (!TokenIsNewline(doc, tok) && !TokenIsEOF(doc, tok))
+	tok++;
+    return tok + 1;
+}
+
+// 行 line からトークン tok を頭に組み直す。tail 以降のトークンは以前
+// と同じものである。古い行の区切りと揃ったところで止め、残りの行はそ
+// のまま使う。組んであった範囲の終わりを越えたら、そこで止める。
+//
+//   行の隙間は line + 1 にあり、組み直した行の区切りを隙間の頭に書き
+//   ながら、隙間の後ろの古い区切りと比べる。隙間の後ろはトークンの数
+//   から引いて数えてあるので、古い区切りの番号を直す必要はない。
+static void RelayoutFrom(Document *doc, size_t line, size_t tail)
+{
+    assert(doc->line_gap == line + 1);
 
-    Token *tokens = GC_MALLOC(sizeof(Token) * ntokens);
+    size_t post = line + 1 + doc->line_gap_length; // 次に比べる古い区切り。
+    size_t post_end = doc->nlines + 1 + doc->line_gap_length;
 
-    int k = 0;
-    for (int i = 0; i < doc->nlines; i++) {
-	for (int j = 0; j < doc->lines[i].ntokens; j++) {
-	    tokens[k] = doc->lines[i].tokens[j];
-	    k++;
+    size_t tok = LineStart(doc, line);
+    while (1) {
+	tok = LayOutTokens(doc, doc->break_plan, tok);
+	if (doc->line_gap == post) {
+	    // 隙間が尽きたら広げ、古い区切りを後ろへずらす。
+	    size_t extra = (post_end - post) / 4 + 16;
+	    ReserveLines(doc, post_end + extra - 1);
+	    memmove(&doc->line_starts[post + extra], &doc->line_starts[post],
+		    sizeof(uint32_t) * (post_end - post));
+	    post += extra;
+	    post_end += extra;
+	}
+	doc->line_starts[doc->line_gap++] = tok;
+	if (tok < tail)
+	    continue;
+
+	if (tok >= doc->ntokens - doc->line_starts[post_end - 1]) {
+	    post = post_end;
+	    break;
+	}
+	while (doc->ntokens - doc->line_starts[post] < tok)
+	    post++;
+	if (doc->ntokens - doc->line_starts[post] == tok) {
+	    post++;
+	    break;
 	}
     }
-    assert(k == ntokens);
 
-    *ntokens_return = ntokens;
-    return tokens;
+    doc->line_gap_length = post - doc->line_gap;
+    doc->nlines = doc->line_gap - 1 + (post_end - post);
+}
+
+// 文字 [from, to) を n 文字の cps に置き換え、影響を受けた段落をレイ
+// アウトし直す。EOF は置き換えられない。
+//
+//   文字とトークンの隙間を段落の終わりへ動かしてから段落の中だけを書
+//   き換える。隙間の後ろの位置は終わりから数えてあるので、後ろの段落
+//   の番号を直す必要はない。手間は段落の長さと前の編集からの距離で決
+//   まり、文書の長さにはよらない。
+static void ReplaceCharacters(Document *doc, size_t from, size_t to, const uint32_t *cps, size_t n)
+{
+    assert(from <= to && to < doc->nchars);
+
+    if (from == to && n == 0)
+	return;
+
+    // 置き換える範囲を含む段落。改行を消すと二つの段落がつながるし、
+    // 改行を入れると段落が分かれる。
+    size_t para_begin = ParagraphBegin(doc, DocumentFindToken(doc, from));
+    size_t para_end = ParagraphEnd(doc, DocumentFindToken(doc, to));
+    size_t old_count = para_end - para_begin;
+    ptrdiff_t char_delta = (ptrdiff_t) n - (ptrdiff_t) (to - from);
+    size_t char_begin = TokenStart(doc, para_begin);
+    size_t old_char_end = TokenStart(doc, para_end);
+
+    MoveTokenGap(doc, para_end);
+    MoveCharacterGap(doc, old_char_end);
+    if (char_delta > 0)
+	GrowCharacterGap(doc, char_delta);
+    size_t ntail = old_char_end - to;
+    memmove(&doc->code_points[from + n], &doc->code_points[to], sizeof(uint32_t) * ntail);
+    memmove(&doc->natural_widths[from + n], &doc->natural_widths[to], sizeof(short) * ntail);
+    memmove(&doc->widths[from + n], &doc->widths[to], sizeof(short) * ntail);
+    memmove(&doc->xs[from + n], &doc->xs[to], sizeof(short) * ntail);
+    if (n > 0)
+	memcpy(&doc->code_points[from], cps, sizeof(uint32_t) * n);
+    doc->nchars += char_delta;
+    doc->char_gap += char_delta;
+    doc->char_gap_length -= char_delta;
+
+    // 段落をトークンに区切り直す。改行と EOF は必ず単独のトークンに
+    // なるので、段落の外のトークンは変わらない。
+    size_t char_end = old_char_end + char_delta;
+    uint32_t *starts = GC_MALLOC_ATOMIC(sizeof(uint32_t) * (char_end - char_begin + 1));
+    size_t new_count = 0;
+    for (size_t c = char_begin; c < char_end; ) {
+	starts[new_count++] = c;
+	c = Tokenize(doc, c);
+	assert(c <= char_end);
+    }
+    starts[new_count] = char_end;
+
+    // 段落の中で変わったトークンの範囲 [first, tail) を求める。前後の
+    // トークンは文字も区切りも元のままである。段落の最後のトークンは
+    // from より後ろで終わるので、比べるまでもなく変わったものとする。
+    const uint32_t *old_starts = &doc->token_starts[para_begin];
+    size_t first = 0;
+    while (first < new_count && first + 1 < old_count &&
+	   starts[first] == old_starts[first] &&
+	   starts[first + 1] == old_starts[first + 1] &&
+	   starts[first + 1] <= from)
+	first++;
+    size_t tail = new_count;
+    while (tail > first && tail - 1 + old_count >= new_count &&
+	   starts[tail - 1] >= from + n &&
+	   starts[tail - 1] - char_delta == old_starts[tail - 1 + old_count - new_count])
+	tail--;
+
+    // 変わったトークンを含む行。その前の行にトークンが入るようになる
+    // かもしれないので、段落の最初の行でなければ一行前から組み直す。ま
+    // だ組んでいない所ならば、組み直すものは無い。
+    //
+    // 最適な改行位置は段落全体で決まるので、そのときは段落の最初の行
+    // から段落の終わりまで組み直す。段落の頭しか組んでいなくても組み
+    // 直す。
+    //
+    // 行の隙間はトークンの数を変える前に動かす。隙間の後ろの区切りは
+    // トークンの数から引いて数えてあるので、それで番号がずれる。
+    size_t first_line_token = optimal_fit ? para_begin : para_begin + first;
+    bool relayout = first_line_token < LineStart(doc, doc->nlines);
+    size_t line = 0;
+    if (relayout) {
+	line = DocumentFindLine(doc, first_line_token);
+	if (LineBegin(doc, line) > para_begin)
+	    line--;
+	MoveLineGap(doc, line + 1);
+    } else {
+	CloseLineGap(doc);
+    }
+    if (optimal_fit)
+	tail = new_count;
+    doc->break_plan->nstarts = 0;
+
+    // 変わったトークンだけを入れ替える。
+    ptrdiff_t token_delta = (ptrdiff_t) new_count - (ptrdiff_t) old_count;
+    size_t splice_begin = para_begin + first;
+    size_t splice_end = para_begin + tail - token_delta;
+    size_t nsplice = tail - first;
+    size_t nkeep = para_end - splice_end;
+    if (token_delta > 0)
+	GrowTokenGap(doc, token_delta);
+    memmove(&doc->token_starts[splice_begin + nsplice], &doc->token_starts[splice_end], sizeof(uint32_t) * nkeep);
+    memmove(&doc->natural_token_widths[splice_begin + nsplice], &doc->natural_token_widths[splice_end], sizeof(short) * nkeep);
+    memmove(&doc->token_xs[splice_begin + nsplice], &doc->token_xs[splice_end], sizeof(short) * nkeep);
+    memmove(&doc->token_widths[splice_begin + nsplice], &doc->token_widths[splice_end], sizeof(short) * nkeep);
+    doc->ntokens += token_delta;
+    doc->token_gap += token_delta;
+    doc->token_gap_length -= token_delta;
+    memcpy(&doc->token_starts[splice_begin], &starts[first], sizeof(uint32_t) * nsplice);
+    for (size_t t = splice_begin + nsplice; t < doc->token_gap; t++)
+	doc->token_starts[t] += char_delta;
+
+    for (size_t t = splice_begin; t < splice_begin + nsplice; t++)
+	MeasureToken(doc, t);
+
+    if (relayout)
+	RelayoutFrom(doc, line, para_begin + tail);
 }
 
-void ResetCharacterWidth(Character *ch)
+// 文字 offset の前に text を挿入し、挿入した文字数を返す。
+//
+//   打った文字は数文字なので、検証も寸法の先読みもせずに変換する。不
+//   正なバイトは U+FFFD になる。文字数はバイト数を超えない。
+size_t DocumentInsert(Document *doc, size_t offset, const char *text, size_t length)
 {
-    ch->width = YFontTextWidth(font, ch->utf8, ch->length);
+    if (length == 0)
+	return 0;
+
+    uint32_t *cps = GC_MALLOC_ATOMIC(sizeof(uint32_t) * length);
+    size_t nchars = DecodeCharacters(text, length, cps) - cps;
+
+    ReplaceCharacters(doc, offset, offset, cps, nchars);
+    return nchars;
 }
 
-Character **ExtractCharacters(Document *doc, size_t *nchars_return)
+// 文字 offset から nchars 文字を削除する。
+void DocumentDelete(Document *doc, size_t offset, size_t nchars)
 {
-    size_t nchars = 0;
-    for (CursorPath it = (CursorPath) { 0, 0, 0 };
-	 !CharacterIsEOF(CursorPathGetCharacter(doc, it));
-	 it = CursorPathForward(doc, it)) {
-	nchars++;
+    ReplaceCharacters(doc, offset, offset + nchars, NULL, 0);
+}
+
+#if defined(DOCUMENT_BENCHMARK) || defined(DOCUMENT_TEST)
+YFont *font;
+WordCache *word_cache;
+int layout_threads = 1;
+bool lazy_layout = false;
+bool optimal_fit = false;
+
+// 行分割で決まる配列の写し。編集していない、隙間の無い文書から取る。
+typedef struct {
+    uint32_t *line_starts;
+    size_t nlines;
+    short *token_xs, *token_widths, *widths, *xs;
+} Layout;
+
+static void *Copy(const void *src, size_t bytes)
+{
+    void *dest = GC_MALLOC_ATOMIC(bytes);
+    memcpy(dest, src, bytes);
+    return dest;
+}
+
+static Layout CopyLayout(const Document *doc)
+{
+    assert(doc->char_gap_length == 0 && doc->token_gap_length == 0 && doc->line_gap_length == 0);
+    return (Layout) {
+	.line_starts = Copy(doc->line_starts, sizeof(uint32_t) * (doc->nlines + 1)),
+	.nlines = doc->nlines,
+	.token_xs = Copy(doc->token_xs, sizeof(short) * doc->ntokens),
+	.token_widths = Copy(doc->token_widths, sizeof(short) * doc->ntokens),
+	.widths = Copy(doc->widths, sizeof(short) * doc->nchars),
+	.xs = Copy(doc->xs, sizeof(short) * doc->nchars),
+    };
+}
+
+static bool SameLayout(const Document *doc, const Layout *layout)
+{
+    return doc->nlines == layout->nlines &&
+	memcmp(doc->line_starts, layout->line_starts, sizeof(uint32_t) * (doc->nlines + 1)) == 0 &&
+	memcmp(doc->token_xs, layout->token_xs, sizeof(short) * doc->ntokens) == 0 &&
+	memcmp(doc->token_widths, layout->token_widths, sizeof(short) * doc->ntokens) == 0 &&
+	memcmp(doc->widths, layout->widths, sizeof(short) * doc->nchars) == 0 &&
+	memcmp(doc->xs, layout->xs, sizeof(short) * doc->nchars) == 0;
+}
+#endif
+
+#ifdef DOCUMENT_BENCHMARK
+// 行分割をスレッドの数を変えて計る。並列に組んだ結果が逐次に組んだも
+// のとバイト単位で同じであることも確かめる。
+//
+//   gcc -O2 -std=c11 -I/usr/include/freetype2 -DDOCUMENT_BENCHMARK -o document-bench document.c arena.c char_class.c cursor_path.c font.c hash.c metrics_cache.c text_source.c utf8-string.c utf8-validate.c util.c word_cache.c -lXft -lX11 -lfontconfig -lgc -lpthread
+//   ./document-bench FILE [FONT]
+#include <time.h>
+#include "text_source.h"
+
+#define REPEAT 10
+#define MAX_BENCHMARK_THREADS 16
+
+// 経過時間。スレッドの CPU 時間を足し合わせないように clock は使わない。
+static double Now(void)
+{
+    struct timespec ts;
+
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+	fprintf(stderr, "Usage: %s FILENAME [FONT]\n", argv[0]);
+	exit(1);
+    }
+    Display *disp = XOpenDisplay(NULL);
+    if (disp == NULL) {
+	fprintf(stderr, "cannot open display\n");
+	exit(1);
+    }
+    font = YFontCreate(disp, (argc == 3) ? argv[2] : "Source Han Sans JP-16");
+    if (font == NULL) {
+	fprintf(stderr, "no such font\n");
+	exit(1);
+    }
+    TextSource *src = TextSourceOpen(argv[1]);
+
+    PageInfo page = { 640, 480, 50, 590, 430, 50 };
+    Document *doc = CreateDocument(src->text, src->length, &page);
+    Layout serial = CopyLayout(doc);
+    printf("%zu chars, %zu tokens, %zu lines\n", doc->nchars, doc->ntokens, doc->nlines);
+
+    double base = 0;
+    for (int n = 1; n <= MAX_BENCHMARK_THREADS; n *= 2) {
+	layout_threads = n;
+	double start = Now();
+	for (int r = 0; r < REPEAT; r++)
+	    DocumentSetPageInfo(doc, &page);
+	double ms = (Now() - start) * 1e3 / REPEAT;
+	if (n == 1)
+	    base = ms;
+
+	bool same = SameLayout(doc, &serial);
+	printf("%2d threads: %8.2f ms  x%.2f  %s\n", n, ms, base / ms, same ? "same" : "DIFFERENT");
+	if (!same)
+	    exit(1);
     }
-    nchars++; // EOFもカウントする
 
-    Character **chars = GC_MALLOC(sizeof(Character *) * nchars);
-    
-    int i = 0;
-    for (CursorPath it = (CursorPath) { 0, 0, 0 };
-	 true;
-	 it = CursorPathForward(doc, it)) {
-	chars[i++] = CursorPathGetCharacter(doc, it);
-	if (CharacterIsEOF(CursorPathGetCharacter(doc, it)))
-	    break;
+    // 最適な改行位置を求める費用を、段落あたりで入るだけ詰める場合と
+    // 比べる。並列に組んでも結果は変わらないことも確かめる。
+    size_t nparagraphs = 0;
+    for (size_t t = 0; t < doc->ntokens; t++)
+	if (TokenIsNewline(doc, t) || TokenIsEOF(doc, t))
+	    nparagraphs++;
+    printf("%zu paragraphs\n", nparagraphs);
+
+    layout_threads = 1;
+    for (int optimal = 0; optimal <= 1; optimal++) {
+	optimal_fit = optimal;
+	double start = Now();
+	for (int r = 0; r < REPEAT; r++)
+	    DocumentSetPageInfo(doc, &page);
+	double us = (Now() - start) * 1e6 / REPEAT / nparagraphs;
+	Layout layout = CopyLayout(doc);
+
+	layout_threads = MAX_BENCHMARK_THREADS;
+	DocumentSetPageInfo(doc, &page);
+	bool same = SameLayout(doc, &layout);
+	layout_threads = 1;
+
+	printf("%s: %8.3f us/paragraph, %zu lines  %s\n",
+	       optimal ? "optimal" : "greedy ", us, layout.nlines, same ? "same" : "DIFFERENT");
+	if (!same)
+	    exit(1);
+    }
+    return 0;
+}
+#endif
+
+#ifdef DOCUMENT_TEST
+// ディスプレイを開かずに、並列に組んだ行分割が逐次に組んだものと同
+// じであることと、乱数で決めた挿入と削除の後の文書が、同じテキスト
+// から作り直した文書と同じであることを確かめる。make test から使う。
+//
+//   make document-test && ./document-test
+
+// 全角 16、半角 8 の幅を始めから書き込んだフォント。BMP の文字の寸法
+// はすべて分かっているので Xft は呼ばれない。
+static YFont *CreateStubFont(void)
+{
+    YFont *font = GC_MALLOC(sizeof(YFont));
+
+    font->string_metrics = HashCreateN(256);
+    font->metrics.space_width = 8;
+    font->metrics.em = 16;
+    font->metrics.ascent = 14;
+    font->metrics.descent = 2;
+    for (int i = 0; i < (0x10000 >> GLYPH_PAGE_BITS); i++) {
+	GlyphMetrics *page = GC_MALLOC_ATOMIC(sizeof(GlyphMetrics) * GLYPH_PAGE_SIZE);
+	for (int j = 0; j < GLYPH_PAGE_SIZE; j++) {
+	    int cp = (i << GLYPH_PAGE_BITS) | j;
+	    page[j] = (GlyphMetrics) { .x_off = (cp < 0x80) ? 8 : 16, .width = (cp < 0x80) ? 8 : 16, .height = 16 };
+	    GlyphMetricsPublish(&page[j]);
+	}
+	font->glyph_pages[i] = page;
     }
+    return font;
+}
 
-    *nchars_return = nchars;
-    return chars;
+static const char *pieces[] = {
+    "吾輩は猫である。", "名前はまだ無い。", "「どこで生れたか、", "とんと見当がつかぬ」",
+    "The quick brown fox ", "jumps over the lazy dog. ", "（括弧）", "、", "ー", "…",
+    "supercalifragilisticexpialidocious ", "\t", "ゃゅょっ", "1234567890 ",
+};
+#define NPIECES (sizeof(pieces) / sizeof(pieces[0]))
+
+// 和文と欧文、約物、タブの混じった nparagraphs 個の段落を決まった順に
+// 並べる。
+static char *GenerateText(int nparagraphs, size_t *length_return)
+{
+    size_t capacity = 1 << 20, length = 0;
+    char *text = GC_MALLOC_ATOMIC(capacity);
+    unsigned int state = 1;
+
+    for (int paragraph = 0; paragraph < nparagraphs; paragraph++) {
+	int n = 1 + paragraph % 37;
+	for (int k = 0; k < n; k++) {
+	    state = state * 1103515245 + 12345;
+	    const char *piece = pieces[(state >> 16) % NPIECES];
+	    size_t bytes = strlen(piece);
+	    if (length + bytes + 1 >= capacity) {
+		capacity *= 2;
+		text = GC_REALLOC(text, capacity);
+	    }
+	    memcpy(text + length, piece, bytes);
+	    length += bytes;
+	}
+	text[length++] = '\n';
+    }
+    *length_return = length;
+    return text;
 }
 
-static void MendDocument(Document *doc)
+// 並列に組む閾値 (LAYOUT_PARALLEL_MIN_TOKENS) を十分に超える長さの文
+// 書を、スレッドの数を変えて組み直す。
+static int TestParallelLayout(void)
 {
-    size_t nchars;
-    Character **chars = ExtractCharacters(doc, &nchars);
-    for (int i = 0; i < nchars; i++)
-	ResetCharacterWidth(chars[i]);
+    static const int threads[] = { 2, 3, 4, 8, 16 };
+    size_t length;
+    char *text = GenerateText(2000, &length);
+    int failures = 0;
+
+    for (int optimal = 0; optimal <= 1; optimal++) {
+	optimal_fit = optimal;
+	layout_threads = 1;
+
+	PageInfo page = { 640, 480, 50, 590, 430, 50 };
+	Document *doc = CreateDocument(text, length, &page);
+	if (doc->ntokens < LAYOUT_PARALLEL_MIN_TOKENS) {
+	    fprintf(stderr, "too few tokens: %zu\n", doc->ntokens);
+	    exit(1);
+	}
+	Layout serial = CopyLayout(doc);
+
+	for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+	    layout_threads = threads[i];
+	    DocumentSetPageInfo(doc, &page);
+	    bool same = SameLayout(doc, &serial);
+	    printf("%s, %2d threads: %zu lines  %s\n",
+		   optimal ? "optimal" : "greedy ", threads[i], doc->nlines, same ? "same" : "DIFFERENT");
+	    if (!same)
+		failures++;
+	}
+    }
+    layout_threads = 1;
+    return failures;
+}
+
+// 編集を施す UTF-8 のテキスト。文書と同じ内容に保つ。
+typedef struct {
+    char *text;
+    size_t length;
+    size_t capacity;
+} Model;
 
-    size_t ntokens;
-    Token *tokens = ExtractTokens(doc, &ntokens);
-    for (int i = 0; i < ntokens; i++)
-	MendToken(&tokens[i]);
+static size_t ModelOffsetToByte(const Model *model, size_t offset)
+{
+    size_t at = 0;
 
-    doc->lines = CreateLines(tokens, ntokens, doc->page, &doc->nlines);
+    for (size_t i = 0; i < offset; i++)
+	at += Utf8CharBytes(&model->text[at]);
+    return at;
 }
 
-Document *CreateDocument(const char *text, const PageInfo *page)
+static void ModelInsert(Model *model, size_t offset, const char *text, size_t length)
 {
-    Document *doc = GC_MALLOC(sizeof(Document));
+    size_t at = ModelOffsetToByte(model, offset);
 
-    size_t nchars;
-    Character *chars = StringToCharacters(text, strlen(text), &nchars); // TODO: ファイルの長さで作る
-    size_t ntokens;
-    Token *tokens = CharactersToTokens(chars, nchars, &ntokens);
+    if (model->length + length + 1 > model->capacity) {
+	model->capacity = (model->length + length + 1) * 2;
+	model->text = GC_REALLOC(model->text, model->capacity);
+    }
+    memmove(&model->text[at + length], &model->text[at], model->length - at);
+    memcpy(&model->text[at], text, length);
+    model->length += length;
+    model->text[model->length] = '\0';
+}
 
-    doc->lines = CreateLines(tokens, ntokens, page, &doc->nlines);
-    doc->page = GC_MALLOC(sizeof(PageInfo));
-    *doc->page = *page;
+static void ModelDelete(Model *model, size_t offset, size_t nchars)
+{
+    size_t at = ModelOffsetToByte(model, offset);
+    size_t end = at;
 
-    return doc;
+    for (size_t i = 0; i < nchars; i++)
+	end += Utf8CharBytes(&model->text[end]);
+    memmove(&model->text[at], &model->text[end], model->length - end + 1);
+    model->length -= end - at;
 }
 
-Token *GetToken(Document *doc, size_t line, size_t token)
+// 文字ごとの配列 a と b の [0, n) が同じかどうか。隙間は飛ばして比べる。
+static bool SameCharacterShorts(const Document *doc, const short *a, const Document *fresh, const short *b, size_t n)
 {
-    VisualLine *ln = GetLine(doc, line);
+    for (size_t c = 0; c < n; c++) {
+	if (a[CharacterSlot(doc, c)] != b[CharacterSlot(fresh, c)])
+	    return false;
+    }
+    return true;
+}
 
-    assert(token < ln->ntokens );
-    return &ln->tokens[token];
+// トークンごとの配列 a と b の [0, n) が同じかどうか。
+static bool SameTokenShorts(const Document *doc, const short *a, const Document *fresh, const short *b, size_t n)
+{
+    for (size_t t = 0; t < n; t++) {
+	if (a[TokenSlot(doc, t)] != b[TokenSlot(fresh, t)])
+	    return false;
+    }
+    return true;
 }
 
-VisualLine *GetLine(Document *doc, size_t line)
+// doc と fresh が同じならば NULL を、違えば違う配列の名前を返す。行
+// はどちらも組んである所までを比べる。
+static const char *DifferentArray(const Document *doc, const Document *fresh)
 {
-    assert(line < doc->nlines);
-    return &doc->lines[line];
+    if (doc->nchars != fresh->nchars)
+	return "nchars";
+    for (size_t c = 0; c < doc->nchars; c++) {
+	if (CodePointAt(doc, c) != CodePointAt(fresh, c))
+	    return "code_points";
+    }
+    if (!SameCharacterShorts(doc, doc->natural_widths, fresh, fresh->natural_widths, doc->nchars))
+	return "natural_widths";
+    if (doc->ntokens != fresh->ntokens)
+	return "ntokens";
+    for (size_t t = 0; t <= doc->ntokens; t++) {
+	if (TokenStart(doc, t) != TokenStart(fresh, t))
+	    return "token_starts";
+    }
+    if (!SameTokenShorts(doc, doc->natural_token_widths, fresh, fresh->natural_token_widths, doc->ntokens))
+	return "natural_token_widths";
+    if (!lazy_layout && doc->nlines != fresh->nlines)
+	return "nlines";
+
+    size_t nlines = (doc->nlines < fresh->nlines) ? doc->nlines : fresh->nlines;
+    for (size_t l = 0; l <= nlines; l++) {
+	if (LineStart(doc, l) != LineStart(fresh, l))
+	    return "line_starts";
+    }
+    size_t ntokens = LineStart(doc, nlines);
+    size_t nchars = TokenStart(doc, ntokens);
+    if (!SameTokenShorts(doc, doc->token_xs, fresh, fresh->token_xs, ntokens))
+	return "token_xs";
+    if (!SameTokenShorts(doc, doc->token_widths, fresh, fresh->token_widths, ntokens))
+	return "token_widths";
+    if (!SameCharacterShorts(doc, doc->widths, fresh, fresh->widths, nchars))
+	return "widths";
+    if (!SameCharacterShorts(doc, doc->xs, fresh, fresh->xs, nchars))
+	return "xs";
+    return NULL;
 }
 
-void DocumentSetPageInfo(Document *doc, PageInfo *page)
+#define NEDITS 300
+
+// 改行をまたぐ挿入と削除を施し、その度に同じテキストから作り直した
+// 文書と比べる。遅延レイアウトでは、組んだ範囲の外の編集と、暇なと
+// きに少しずつ組むことも混ぜる。
+static int TestEdits(void)
 {
-    *doc->page = *page;
-    MendDocument(doc);
+    static const char *inserts[] = {
+	"x", " ", "\n", "\n\n", "あ", "。", "「", "」", "\t", "word ", "改行の\n前後", "、」",
+    };
+    size_t ninserts = sizeof(inserts) / sizeof(inserts[0]);
+    int failures = 0;
+
+    for (int lazy = 0; lazy <= 1; lazy++) {
+	for (int optimal = 0; optimal <= 1; optimal++) {
+	    lazy_layout = lazy;
+	    optimal_fit = optimal;
+	    srand(1);
+
+	    Model model;
+	    model.text = GenerateText(300, &model.length);
+	    model.capacity = model.length;
+	    model.text[model.length] = '\0';
+
+	    PageInfo page = { 640, 480, 50, 590, 430, 50 };
+	    Document *doc = CreateDocument(model.text, model.length, &page);
+	    int i;
+	    for (i = 0; i < NEDITS; i++) {
+		size_t nchars = doc->nchars - 1; // EOF を除く。
+		size_t offset = rand() % (nchars + 1);
+		if (rand() % 2 == 0 && offset < nchars) {
+		    size_t n = 1 + rand() % 40;
+		    if (n > nchars - offset)
+			n = nchars - offset;
+		    DocumentDelete(doc, offset, n);
+		    ModelDelete(&model, offset, n);
+		} else {
+		    const char *text = inserts[rand() % ninserts];
+		    DocumentInsert(doc, offset, text, strlen(text));
+		    ModelInsert(&model, offset, text, strlen(text));
+		}
+		if (lazy && rand() % 8 == 0)
+		    DocumentLayOutMore(doc, 16);
+
+		Document *fresh = CreateDocument(model.text, model.length, &page);
+		const char *different = DifferentArray(doc, fresh);
+		if (different) {
+		    fprintf(stderr, "lazy=%d optimal=%d: %s differs after edit %d\n", lazy, optimal, different, i);
+		    failures++;
+		    break;
+		}
+	    }
+	    fprintf(stderr, "%s, %s: %d edits  %s\n", lazy ? "lazy " : "eager", optimal ? "optimal" : "greedy ",
+		    i, (i == NEDITS) ? "same" : "DIFFERENT");
+	}
+    }
+    lazy_layout = false;
+    optimal_fit = false;
+    return failures;
+}
+
+int main(void)
+{
+    font = CreateStubFont();
+    int failures = TestParallelLayout();
+
+    // 作り直す度に出る経過表示は捨て、結果は標準エラーに書く。
+    fflush(stdout);
+    freopen("/dev/null", "w", stdout);
+    failures += TestEdits();
+    return failures ? 1 : 0;
 }
+#endif
@@ -2,67 +2,125 @@
 #define DOCUMENT_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <X11/Xft/Xft.h>
+#include "arena.h"
 
-#define MAX_UTF8_CHAR_LENGTH 6
+typedef struct BreakPlan BreakPlan;
 
 typedef struct {
-    short x;
-    short width;
-    char utf8[MAX_UTF8_CHAR_LENGTH + 1];
-    size_t length;
-} Character;
+    short width, height;
+    short margin_top, margin_right, margin_bottom, margin_left;
+} PageInfo;
 
+// 文書。文字、トークン、行をそれぞれ一続きの配列に持つ。
+//
+//   トークン t は文字 [token_starts[t], token_starts[t + 1]) からなり、
+//   行 l はトークン [line_starts[l], line_starts[l + 1]) からなる。最後
+//   の文字は EOF の番兵で、それだけで最後のトークンになる。これらは文
+//   字数とトークン数の累積和でもあるので、位置から行やトークンを二分
+//   探索で引ける (DocumentFindLine, DocumentFindToken)。
+//
+//   トークンへの区切りとフォントから求めた幅 (natural_*) はページの幅
+//   に依らないので、作成時に一度だけ求める。ページの幅が変わったとき
+//   は、行分割と行ごとの幅の調整だけをやり直す。
+//
+//   文字を挿入・削除したときは、その段落だけをトークンに区切り直し、
+//   変わった行から組み直す。行の区切りが元と揃ったところで止める。
+//
+//   編集のために、三つの配列はそれぞれ一つの隙間を持つ (ギャップバッ
+//   ファ)。要素 i は隙間の前ならば i に、後ろならば i + 隙間の長さに
+//   置く (CharacterSlot, TokenSlot)。隙間の後ろの token_starts と
+//   line_starts は、文書の終わりから数えて (nchars - 位置、ntokens -
+//   番号) 持つ。編集する段落の後ろへ隙間を動かしておけば、後ろの要素
+//   は動かさずに済み、その番号も書き換えずに済む。一回の編集にかかる
+//   時間は、段落の長さと、前の編集の位置から隙間を動かす距離とで決ま
+//   り、文書の長さには依らない。
+//
+//   文字とトークンの隙間は段落の区切りにしか置かないので、一つの行の
+//   トークンと一つのトークンの文字は続けて並ぶ。
+//
+//   行は文書の頭から組んだ分だけがある。行 nlines の頭が組んで
+//   いない最初のトークンで、全て組めば ntokens になる。
 typedef struct {
-    short x;
-    short width;
-    Character *chars;
+    // 文字ごとの配列。nchars 要素と隙間。
+    uint32_t *code_points;
+    short *natural_widths;
+    // 行の中での幅。括弧類は行頭や行末で詰められる。
+    short *widths;
+    // トークンの左端からの位置。
+    short *xs;
     size_t nchars;
-} Token;
+    // 隙間の前の要素数と、隙間の長さ。隙間が無ければ char_gap は
+    // SIZE_MAX。他の配列も同じ。
+    size_t char_gap;
+    size_t char_gap_length;
 
-typedef struct  {
-    Token *tokens;
+    // トークンごとの配列。token_starts だけは ntokens + 1 要素。
+    uint32_t *token_starts;
+    short *natural_token_widths;
+    // 行の左端からの位置。
+    short *token_xs;
+    // 行の中での幅。両端揃えで伸び縮みする。
+    short *token_widths;
     size_t ntokens;
-} VisualLine;
-
-typedef struct {
-    short width, height;
-    short margin_top, margin_right, margin_bottom, margin_left;
-} PageInfo;
+    size_t token_gap;
+    size_t token_gap_length;
 
-typedef struct {
-    VisualLine *lines;
+    // nlines + 1 要素と隙間。layout_arena の中にあり、レイアウトし直す
+    // と無効になる。
+    uint32_t *line_starts;
     size_t nlines;
+    // 隙間を含めて確保してある行数。
+    size_t line_capacity;
+    size_t line_gap;
+    size_t line_gap_length;
+    // レイアウトの一回分の領域。
+    Arena *layout_arena;
+    // 最適な改行位置を求めるときの、組んでいる段落の計画。
+    BreakPlan *break_plan;
+
     PageInfo *page;
 } Document;
 
+// 文字 c の配列での位置。
+static inline size_t CharacterSlot(const Document *doc, size_t c)
+{
+    return (c < doc->char_gap) ? c : c + doc->char_gap_length;
+}
+
+// トークン tok の配列での位置。
+static inline size_t TokenSlot(const Document *doc, size_t tok)
+{
+    return (tok < doc->token_gap) ? tok : tok + doc->token_gap_length;
+}
+
 #include "cursor_path.h"
 
-Character **ExtractCharacters(Document *doc, size_t *nchars_return);
-void CharacterInitialize(Character *ch, short x, const char *utf8, size_t bytes);
-bool CharacterIsEOF(Character *ch);
-Token *CharactersToTokens(Character text[], size_t nchars, size_t *ntokens_return);
-Document *CreateDocument(const char *text, const PageInfo *page);
+bool CharacterIsEOF(const Document *doc, size_t c);
+Document *CreateDocument(const char *text, size_t length, const PageInfo *page);
+void DocumentDelete(Document *doc, size_t offset, size_t nchars);
+bool DocumentEnsureLine(Document *doc, size_t line);
+void DocumentEnsureToken(Document *doc, size_t tok);
+size_t DocumentFindLine(const Document *doc, size_t tok);
+size_t DocumentFindToken(const Document *doc, size_t c);
+size_t DocumentInsert(Document *doc, size_t offset, const char *text, size_t length);
+bool DocumentIsLaidOut(const Document *doc);
+bool DocumentLayOutMore(Document *doc, size_t nlines);
 void DocumentSetPageInfo(Document *doc, PageInfo *page);
-Token *ExtractTokens(Document *doc, size_t *ntokens_return);
-Token *FillLine(VisualLine **line_return, Token *input, const PageInfo *page);
-VisualLine *GetLine(Document *doc, size_t line);
-Token *GetToken(Document *doc, size_t line, size_t token);
-void InspectLine(VisualLine *line);
-void JustifyLine(VisualLine *line, const PageInfo *page);
+void InspectLine(const Document *doc, size_t line);
+void JustifyLine(Document *doc, size_t line);
+size_t LineBegin(const Document *doc, size_t line);
+size_t LineEnd(const Document *doc, size_t line);
+short LineGetWidth(const Document *doc, size_t line);
 short PageInfoGetVisibleWidth(const PageInfo *page);
-void ResetCharacterWidth(Character *ch);
-Character *StringToCharacters(const char *text, size_t length, size_t *nchars_return);
-void TokenAddCharacter(Token *tok, Character *ch);
-Token *TokenCreate(void);
-short TokenEOF(Token *tok, short x);
-void TokenInitialize(Token *tok);
-bool TokenIsEOF(Token *tok);
-bool TokenIsNewline(Token *tok);
-bool TokenIsSpace(Token *tok);
-void UpdateTokenPositions(VisualLine *line);
-void VisualLineAddToken(VisualLine *line, Token *tok);
-VisualLine *VisualLineCreate(void);
-short VisualLineGetWidth(VisualLine *line);
+uint32_t *StringToCharacters(const char *text, size_t length, size_t *nchars_return);
+size_t TokenBegin(const Document *doc, size_t tok);
+size_t TokenEnd(const Document *doc, size_t tok);
+bool TokenIsEOF(const Document *doc, size_t tok);
+bool TokenIsNewline(const Document *doc, size_t tok);
+bool TokenIsSpace(const Document *doc, size_t tok);
+void UpdateTokenPositions(Document *doc, size_t line);
 
 #endif
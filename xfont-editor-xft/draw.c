@@ -10,6 +10,7 @@
 #include <gc.h>
 
 #include "view.h"
+#include "text_source.h"
 #include "editor.h"
 #include "utf8-string.h"
 
@@ -157,7 +158,7 @@ int main(int argc, char *argv[])
 	exit(1);
     }
        
-    const char *text = ReadFile(argv[1]);
+    TextSource *source = TextSourceOpen(argv[1]);
 
     for (int i = 0; i < 10 && names[i] != NULL; i++) {
 	ViewSetOption(names[i], values[i]);
@@ -165,7 +166,7 @@ int main(int argc, char *argv[])
        
     PageInfo *page;
     page = GetPageInfo(XtDisplay(draw), XtWindow(draw));
-    ViewInitialize(XtDisplay(draw), XtWindow(draw), text, page);
+    ViewInitialize(XtDisplay(draw), XtWindow(draw), source, page);
 
     XtAddEventHandler(draw, KeyPressMask, False, 
 		      keypress_callbck, NULL);
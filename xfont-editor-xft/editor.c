@@ -1,5 +1,5 @@
 /**
- * カーソル移動ができるテキストエディタ。
+ * カーソル移動と文字の入力ができるテキストエディタ。
  */
 
 #include <alloca.h>
@@ -19,6 +19,7 @@
 #include "utf8-string.h"
 #include "editor.h"
 #include "view.h"
+#include "text_source.h"
 
 static Display *disp;
 static Window win;
@@ -39,8 +40,8 @@ void Initialize()
     XSetWMProtocols(disp, win, &WM_DELETE_WINDOW, 1);
 
     XMapWindow(disp, win);
-    // 暴露イベントを受け取る。
-    XSelectInput(disp, win, ExposureMask | KeyPressMask);
+    // 暴露イベントとキーと、左ボタンのクリックとドラッグを受け取る。
+    XSelectInput(disp, win, ExposureMask | KeyPressMask | ButtonPressMask | Button1MotionMask);
 
     atexit(CleanUp);
 }
@@ -72,6 +73,30 @@ void HandleKeyPress(XKeyEvent *ev)
     case XK_Down:
 	needs_redraw = ViewDownwardCursor();
 	break;
+    case XK_Prior:
+	needs_redraw = ViewPageUp();
+	break;
+    case XK_Next:
+	needs_redraw = ViewPageDown();
+	break;
+    case XK_Return:
+	needs_redraw = ViewInsertText("\n", 1);
+	break;
+    case XK_BackSpace:
+	needs_redraw = ViewDeleteBackward();
+	break;
+    case XK_Delete:
+	needs_redraw = ViewDeleteForward();
+	break;
+    default: {
+	// インプットメソッドは使わないので、入力できるのは ASCII の印字
+	// 可能文字とタブだけ。
+	char buf[8];
+	int len = XLookupString(ev, buf, sizeof(buf), NULL, NULL);
+	if (len == 1 && (isprint((unsigned char) buf[0]) || buf[0] == '\t'))
+	    needs_redraw = ViewInsertText(buf, 1);
+	break;
+    }
     }
 
     if (needs_redraw) {
@@ -79,6 +104,13 @@ void HandleKeyPress(XKeyEvent *ev)
     }
 }
 
+// ポインターの位置にカーソルを置く。
+void HandlePointer(int x, int y)
+{
+    if (ViewSetCursor(ViewHitTest(x, y)))
+	ViewRedraw();
+}
+
 void GetPageInfo(PageInfo *page)
 {
     // ウィンドウのサイズを取得する。
@@ -103,14 +135,18 @@ int main(int argc, char *argv[])
 
     Initialize();
 
-    const char *text = ReadFile(argv[1]);
+    TextSource *source = TextSourceOpen(argv[1]);
 
     PageInfo page;
     GetPageInfo(&page);
-    ViewInitialize(disp, win, text, &page);
+    ViewInitialize(disp, win, source, &page);
 
     XEvent ev;
     while (1) { // イベントループ
+	// イベントが来ていなければ、残りの行を組む。
+	if (!XPending(disp) && ViewLayOutMore())
+	    continue;
+
 	XNextEvent(disp, &ev);
 
 	switch (ev.type) {
@@ -124,6 +160,17 @@ int main(int argc, char *argv[])
 	    puts("keypress");
 	    HandleKeyPress((XKeyEvent *) &ev);
 	    break;
+	case ButtonPress:
+	    if (ev.xbutton.button == Button1)
+		HandlePointer(ev.xbutton.x, ev.xbutton.y);
+	    break;
+	case MotionNotify:
+	    // 溜まっている移動イベントは最後のものだけを使う。描画が追い
+	    // つかなくても遅れが積もらない。
+	    while (XCheckTypedWindowEvent(disp, win, MotionNotify, &ev))
+		;
+	    HandlePointer(ev.xmotion.x, ev.xmotion.y);
+	    break;
 	case ClientMessage:
 	    exit(0);
 	}
@@ -1,47 +1,210 @@
 #include "font.h"
+#include "utf8-string.h"
 #include <gc.h>
+#include <string.h>
+
+static void MeasureUncached(YFont *font, const char *str, int bytes, GlyphMetrics *metrics)
+{
+    XGlyphInfo extents;
+
+    XftTextExtentsUtf8
+	(font->disp, font->xft_font, (FcChar8 *) str, bytes, &extents);
+    metrics->x_off = extents.xOff;
+    metrics->x = extents.x;
+    metrics->y = extents.y;
+    metrics->width = extents.width;
+    metrics->height = extents.height;
+    GlyphMetricsPublish(metrics);
+}
 
 YFont *YFontCreate(Display *disp, const char *font_desc)
 {
+    static unsigned int next_id = 0;
     YFont *font;
 
     font = GC_MALLOC(sizeof(YFont));
     font->disp = disp;
-    font->glyph_widths = HashCreateN(4096);
+    font->id = next_id++;
+    font->string_metrics = HashCreateN(256);
     font->xft_font =
 	XftFontOpenName(disp, DefaultScreen(disp), font_desc);
 
     if (font->xft_font == NULL) {
-	font = NULL;
+	return NULL;
+    }
+
+    GlyphMetrics space;
+    MeasureUncached(font, " ", 1, &space);
+    font->metrics.space_width = space.x_off;
+    FcPatternGetDouble(font->xft_font->pattern, FC_PIXEL_SIZE, 0, &font->metrics.em);
+    font->metrics.ascent = font->xft_font->ascent;
+    font->metrics.descent = font->xft_font->descent;
+
+    GlyphMetrics *cached = MetricsCacheOpen(font->xft_font);
+    if (cached) {
+	for (int i = 0; i < (0x10000 >> GLYPH_PAGE_BITS); i++)
+	    font->glyph_pages[i] = cached + i * GLYPH_PAGE_SIZE;
     }
     return font;
 }
 
-void YFontTextExtents(YFont *font, const char *str, int bytes, XGlyphInfo *extents_return)
+// BMP の文字 cp の寸法を置く場所を返す。
+static GlyphMetrics *GlyphSlot(YFont *font, int32_t cp)
 {
-    XftTextExtentsUtf8 (font->disp, font->xft_font, (FcChar8 *) str, bytes, extents_return);
+    GlyphMetrics **page = &font->glyph_pages[cp >> GLYPH_PAGE_BITS];
+
+    if (*page == NULL) {
+	*page = GC_MALLOC_ATOMIC(sizeof(GlyphMetrics) * GLYPH_PAGE_SIZE);
+	memset(*page, 0, sizeof(GlyphMetrics) * GLYPH_PAGE_SIZE);
+    }
+    return &(*page)[cp & (GLYPH_PAGE_SIZE - 1)];
 }
 
-static int TextWidthUncached(YFont *font, const char *str, int bytes)
+// str の寸法をキャッシュから引く。無ければ Xft に問い合わせて登録する。
+static const GlyphMetrics *Measure(YFont *font, const char *str, int bytes)
 {
-    XGlyphInfo extents;
+    int32_t cp = -1;
+    size_t char_bytes;
 
-    XftTextExtentsUtf8
-	(font->disp, font->xft_font, (FcChar8 *) str, bytes, &extents);
-    return extents.xOff;
+    if (bytes > 0 && bytes <= 3)
+	cp = Utf8DecodeChar(str, bytes, &char_bytes);
+
+    if (cp >= 0 && char_bytes == (size_t) bytes) {
+	// 1 文字だけの BMP の文字。
+	GlyphMetrics *metrics = GlyphSlot(font, cp);
+	if (GlyphMetricsIsKnown(metrics)) {
+	    font->cache_hits++;
+	} else {
+	    font->cache_misses++;
+	    MeasureUncached(font, str, bytes, metrics);
+	}
+	return metrics;
+    }
+
+    String key = { str, bytes };
+    GlyphMetrics *metrics = HashGet(font->string_metrics, key);
+    if (metrics) {
+	font->cache_hits++;
+    } else {
+	font->cache_misses++;
+	metrics = GC_MALLOC_ATOMIC(sizeof(GlyphMetrics));
+	MeasureUncached(font, str, bytes, metrics);
+	HashSet(font->string_metrics, key, metrics);
+    }
+    return metrics;
 }
 
-int YFontTextWidth(YFont *font, const char *str, int bytes)
+// 符号位置 cp の文字の寸法を引く。BMP の文字ならば UTF-8 に直さずに
+// 表を引ける。
+static const GlyphMetrics *MeasureCodePoint(YFont *font, uint32_t cp)
 {
-    String key = { str, bytes };
-    int *pWidth = HashGet(font->glyph_widths, key);
+    char utf8[4];
 
-    if (!pWidth) {
-	pWidth = GC_MALLOC(sizeof(int));
-	*pWidth = TextWidthUncached(font, str, bytes);
-	HashSet(font->glyph_widths, key, pWidth);
+    if (cp <= 0xffff) {
+	GlyphMetrics *metrics = GlyphSlot(font, cp);
+	if (GlyphMetricsIsKnown(metrics)) {
+	    font->cache_hits++;
+	} else {
+	    font->cache_misses++;
+	    MeasureUncached(font, utf8, Utf8EncodeChar(cp, utf8), metrics);
+	}
+	return metrics;
     }
-    return *pWidth;
+    return Measure(font, utf8, Utf8EncodeChar(cp, utf8));
+}
+
+// text に現れる BMP の文字のうち、まだ寸法の分からないものをまとめて
+// 求める。文字ごとに XftTextExtentsUtf8 を呼ぶと、その度に UTF-8 の
+// 復号とグリフの読み込みが起こるので、先に異なる文字だけを集めて
+// XftFontLoadGlyphs で一度に読み込む。
+void YFontPrefetch(YFont *font, const char *text, size_t length)
+{
+    uint8_t wanted[0x10000 / 8];
+    size_t ncodes = 0;
+
+    memset(wanted, 0, sizeof(wanted));
+    for (size_t i = 0; i < length; ) {
+	int32_t cp;
+	size_t bytes;
+
+	if ((unsigned char) text[i] < 0x80) {
+	    cp = text[i];
+	    bytes = 1;
+	} else {
+	    cp = Utf8DecodeChar(text + i, length - i, &bytes);
+	    if (cp < 0) {
+		i++;
+		continue;
+	    }
+	}
+	i += bytes;
+
+	if (cp > 0xffff || (wanted[cp >> 3] & (1 << (cp & 7))))
+	    continue;
+	if (font->glyph_pages[cp >> GLYPH_PAGE_BITS] &&
+	    GlyphMetricsIsKnown(GlyphSlot(font, cp)))
+	    continue;
+	wanted[cp >> 3] |= 1 << (cp & 7);
+	ncodes++;
+    }
+    if (ncodes == 0)
+	return;
+
+    FcChar32 *codes = GC_MALLOC_ATOMIC(sizeof(FcChar32) * ncodes);
+    FT_UInt *glyphs = GC_MALLOC_ATOMIC(sizeof(FT_UInt) * ncodes);
+    size_t n = 0;
+    for (int32_t cp = 0; cp <= 0xffff; cp++) {
+	if (wanted[cp >> 3] & (1 << (cp & 7))) {
+	    codes[n] = cp;
+	    glyphs[n] = XftCharIndex(font->disp, font->xft_font, cp);
+	    n++;
+	}
+    }
+
+    XftFontLoadGlyphs(font->disp, font->xft_font, FcFalse, glyphs, n);
+    for (size_t i = 0; i < n; i++) {
+	XGlyphInfo extents;
+	GlyphMetrics *metrics = GlyphSlot(font, codes[i]);
+
+	XftGlyphExtents(font->disp, font->xft_font, &glyphs[i], 1, &extents);
+	metrics->x_off = extents.xOff;
+	metrics->x = extents.x;
+	metrics->y = extents.y;
+	metrics->width = extents.width;
+	metrics->height = extents.height;
+	GlyphMetricsPublish(metrics);
+    }
+    font->cache_misses += n;
+}
+
+static void MetricsToExtents(const GlyphMetrics *metrics, XGlyphInfo *extents_return)
+{
+    memset(extents_return, 0, sizeof(XGlyphInfo));
+    extents_return->xOff = metrics->x_off;
+    extents_return->x = metrics->x;
+    extents_return->y = metrics->y;
+    extents_return->width = metrics->width;
+    extents_return->height = metrics->height;
+}
+
+void YFontCharExtents(YFont *font, uint32_t cp, XGlyphInfo *extents_return)
+{
+    MetricsToExtents(MeasureCodePoint(font, cp), extents_return);
+}
+
+int YFontCharWidth(YFont *font, uint32_t cp)
+{
+    return MeasureCodePoint(font, cp)->x_off;
+}
+
+void YFontTextExtents(YFont *font, const char *str, int bytes, XGlyphInfo *extents_return)
+{
+    MetricsToExtents(Measure(font, str, bytes), extents_return);
+}
+
+int YFontTextWidth(YFont *font, const char *str, int bytes)
+{
+    return Measure(font, str, bytes)->x_off;
 }
 
 void YFontDestroy(YFont *font)
@@ -51,8 +214,5 @@ void YFontDestroy(YFont *font)
 
 double YFontEm(YFont *font)
 {
-    double em;
-
-    FcPatternGetDouble(font->xft_font->pattern, FC_PIXEL_SIZE, 0, &em);
-    return em;
+    return font->metrics.em;
 }
@@ -1,22 +1,49 @@
 #ifndef FONT_H
 #define FONT_H
 
+#include <stdbool.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 #include "hash.h"
+#include "metrics_cache.h"
+
+#define GLYPH_PAGE_BITS 8
+#define GLYPH_PAGE_SIZE (1 << GLYPH_PAGE_BITS)
+
+// フォント全体の寸法。作成時に一度だけ求める。
+typedef struct
+{
+    short space_width;
+    double em;
+    short ascent;
+    short descent;
+} YFontMetrics;
 
 typedef struct
 {
     Display *disp;
-    Hash *glyph_widths;
     XftFont *xft_font;
+    // 作成された順に振られる番号。フォントごとのキャッシュのキーに使う。
+    unsigned int id;
+    YFontMetrics metrics;
+    // BMP の文字の寸法は符号位置で引く。キャッシュファイルが使えれば
+    // ページはその中を指す。そうでなければ初めて使うときに確保する。
+    GlyphMetrics *glyph_pages[0x10000 >> GLYPH_PAGE_BITS];
+    // BMP 外の文字や、複数の文字からなる文字列の寸法。UTF-8 で引く。
+    Hash *string_metrics;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
 } YFont;
 
 // Fontconfig のフォント指定文字列から Font を作る。
 YFont *YFontCreate(Display *disp, const char *font_description);
+// 符号位置 cp の 1 文字の寸法。UTF-8 に直さずに表を引く。
+void YFontCharExtents(YFont *font, uint32_t cp, XGlyphInfo *extents_return);
+int YFontCharWidth(YFont *font, uint32_t cp);
 int YFontTextWidth(YFont *, const char *str, int bytes);
 void YFontDestroy(YFont *);
 double YFontEm(YFont *font);
+void YFontPrefetch(YFont *font, const char *text, size_t length);
 void YFontTextExtents(YFont *font, const char *str, int bytes, XGlyphInfo *extents_return);
 
 #endif
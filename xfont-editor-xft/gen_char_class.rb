@@ -0,0 +1,91 @@
+# char_class.txt から char_class.c を生成する。
+#
+#   ruby gen_char_class.rb char_class.txt > char_class.c
+#
+# 符号位置から文字クラスへの表は二段にする。符号位置の上位ビットでペー
+# ジ番号を引き、下位ビットでページ内を引く。同じ内容のページは一つに
+# まとめるので、どのクラスにも属さない文字のページは全て 0 番を共有す
+# る。基本多言語面の外の文字は表に持たない。
+
+Encoding.default_external = Encoding::UTF_8
+
+# char_class.h の定義と同じであること。
+CLASSES = {
+  'FORBIDDEN_AT_START' => 0x01,
+  'FORBIDDEN_AT_END' => 0x02,
+  'OPEN_PAREN' => 0x04,
+  'CLOSE_PAREN' => 0x08,
+  'COMMA' => 0x10,
+  'PERIOD' => 0x20,
+  'MIDDLE_DOT' => 0x40,
+  'WORD' => 0x80,
+}
+
+PAGE_BITS = 7
+PAGE_SIZE = 1 << PAGE_BITS
+NPAGES = 0x10000 / PAGE_SIZE
+
+classes = Array.new(0x10000, 0)
+members = Hash.new { |h, k| h[k] = [] }
+
+ARGF.each_line do |line|
+  line.chomp!
+  next if line.empty? || line.start_with?('#')
+  name, *items = line.split
+  bit = CLASSES[name] or abort "#{ARGF.lineno}: unknown class #{name}"
+  items.each do |item|
+    cps = case item
+          when /\AU\+(\h+)\.\.U\+(\h+)\z/ then ($1.hex..$2.hex).to_a
+          when /\AU\+(\h+)\z/ then [$1.hex]
+          else item.codepoints
+          end
+    cps.each do |cp|
+      abort "#{ARGF.lineno}: U+%04X is outside the BMP" % cp if cp >= 0x10000
+      classes[cp] |= bit
+      members[bit] << cp
+    end
+  end
+end
+
+# ページに分ける。0 番は全て 0 のページ。
+pages = [Array.new(PAGE_SIZE, 0)]
+page_numbers = { pages[0] => 0 }
+page_index = classes.each_slice(PAGE_SIZE).map do |page|
+  page_numbers[page] ||= (pages << page; pages.size - 1)
+end
+abort "too many pages" if pages.size > 256
+
+# 生成した表で全ての文字のクラスが引けることを確かめる。
+members.each do |bit, cps|
+  cps.each do |cp|
+    got = pages[page_index[cp >> PAGE_BITS]][cp & (PAGE_SIZE - 1)]
+    abort "U+%04X: expected 0x%02X in 0x%02X" % [cp, bit, got] if got & bit == 0
+  end
+end
+
+puts "// gen_char_class.rb によって char_class.txt から生成された。編集しないこと。"
+puts "#include <stdint.h>"
+puts "#include \"char_class.h\""
+puts
+puts "_Static_assert(CHAR_CLASS_PAGE_BITS == #{PAGE_BITS}, \"gen_char_class.rb と char_class.h で PAGE_BITS が違う\");"
+CLASSES.each do |name, bit|
+  puts "_Static_assert(CHAR_#{name} == 0x%02X, \"gen_char_class.rb と char_class.h で CHAR_#{name} が違う\");" % bit
+end
+puts
+
+puts "const uint8_t CharClassPageIndex[#{NPAGES}] = {"
+page_index.each_slice(16) do |indices|
+  puts "    " + indices.map { |i| "%3d," % i }.join(" ")
+end
+puts "};"
+puts
+
+puts "const uint8_t CharClassPages[#{pages.size}][#{PAGE_SIZE}] = {"
+pages.each_with_index do |page, i|
+  puts "    { // #{i}"
+  page.each_slice(8) do |bits|
+    puts "\t" + bits.map { |b| "0x%02X," % b }.join(" ")
+  end
+  puts "    },"
+end
+puts "};"
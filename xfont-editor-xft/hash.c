@@ -4,8 +4,211 @@
 #include <string.h>
 #include "hash.h"
 
+// 使用率がこれを超えたら大きくする。
+#define MAX_LOAD_NUMERATOR 4
+#define MAX_LOAD_DENOMINATOR 5
+
+// FNV-1a
+static uint32_t hash(const unsigned char *str, size_t bytes)
+{
+    uint32_t hash = 2166136261u;
+
+    while (bytes--) {
+	hash ^= *str++;
+	hash *= 16777619u;
+    }
+
+    // 0 は空きの印に使う。
+    return hash ? hash : 1;
+}
+
+static inline const char *EntryKey(const HashEntry *e)
+{
+    return (e->bytes <= HASH_INLINE_KEY_SIZE) ? e->inline_key : e->key;
+}
+
+// 本来の位置からどれだけ離れているか。
+static inline size_t ProbeDistance(const Hash *h, uint32_t hash, size_t index)
+{
+    return (index - (hash & (h->capacity - 1))) & (h->capacity - 1);
+}
+
+Hash *HashCreateN(size_t n)
+{
+    Hash *h = GC_MALLOC(sizeof(Hash));
+
+    // n 個入れても大きくしなくて済むようにする。
+    size_t capacity = 16;
+    while (capacity * MAX_LOAD_NUMERATOR < n * MAX_LOAD_DENOMINATOR)
+	capacity *= 2;
+
+    h->entries = GC_MALLOC(sizeof(HashEntry) * capacity);
+    h->capacity = capacity;
+    h->count = 0;
+    return h;
+}
+
+static HashEntry *Find(Hash *h, String key, uint32_t hv)
+{
+    size_t mask = h->capacity - 1;
+
+    for (size_t i = hv & mask, dist = 0; ; i = (i + 1) & mask, dist++) {
+	HashEntry *e = &h->entries[i];
+
+	// 空きか、自分より本来の位置に近いエントリに出会ったら、このキー
+	// は無い。
+	if (e->hash == 0 || ProbeDistance(h, e->hash, i) < dist)
+	    return NULL;
+	if (e->hash == hv && e->bytes == key.bytes &&
+	    memcmp(EntryKey(e), key.buf, key.bytes) == 0)
+	    return e;
+    }
+}
+
+// 新しいエントリを置く。キーが無いことは分かっているものとする。
+static void Insert(Hash *h, HashEntry entry)
+{
+    size_t mask = h->capacity - 1;
+    size_t dist = 0;
+
+    for (size_t i = entry.hash & mask; ; i = (i + 1) & mask, dist++) {
+	HashEntry *e = &h->entries[i];
+
+	if (e->hash == 0) {
+	    *e = entry;
+	    h->count++;
+	    return;
+	}
+	// 本来の位置から遠い方を優先して置く。
+	size_t existing_dist = ProbeDistance(h, e->hash, i);
+	if (existing_dist < dist) {
+	    HashEntry tmp = *e;
+	    *e = entry;
+	    entry = tmp;
+	    dist = existing_dist;
+	}
+    }
+}
+
+static void Grow(Hash *h)
+{
+    HashEntry *old_entries = h->entries;
+    size_t old_capacity = h->capacity;
+
+    h->capacity *= 2;
+    h->entries = GC_MALLOC(sizeof(HashEntry) * h->capacity);
+    h->count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+	if (old_entries[i].hash != 0)
+	    Insert(h, old_entries[i]);
+    }
+}
+
+static HashEntry *Lookup(Hash *h, String key)
+{
+    return Find(h, key, hash((const unsigned char *) key.buf, key.bytes));
+}
+
+static void Store(Hash *h, String key, HashValue value)
+{
+    uint32_t hv = hash((const unsigned char *) key.buf, key.bytes);
+    HashEntry *e = Find(h, key, hv);
+
+    if (e) {
+	e->value = value;
+	return;
+    }
+
+    if ((h->count + 1) * MAX_LOAD_DENOMINATOR > h->capacity * MAX_LOAD_NUMERATOR)
+	Grow(h);
+
+    HashEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.hash = hv;
+    entry.bytes = key.bytes;
+    if (key.bytes <= HASH_INLINE_KEY_SIZE) {
+	memcpy(entry.inline_key, key.buf, key.bytes);
+    } else {
+	char *copy = GC_MALLOC_ATOMIC(key.bytes);
+	memcpy(copy, key.buf, key.bytes);
+	entry.key = copy;
+    }
+    entry.value = value;
+    Insert(h, entry);
+}
+
+void *HashGet(Hash *h, String key)
+{
+    HashEntry *e = Lookup(h, key);
+
+    return e ? e->value.ptr : NULL;
+}
+
+bool HashGetInt(Hash *h, String key, intptr_t *value_return)
+{
+    HashEntry *e = Lookup(h, key);
+
+    if (!e)
+	return false;
+    *value_return = e->value.integer;
+    return true;
+}
+
+// key を取り除く。取り除いたら true を返す。
+bool HashRemove(Hash *h, String key)
+{
+    HashEntry *e = Lookup(h, key);
+
+    if (!e)
+	return false;
+
+    // 後ろのエントリを本来の位置に近付けるように詰める。
+    size_t mask = h->capacity - 1;
+    size_t i = e - h->entries;
+    for (size_t next = (i + 1) & mask;
+	 h->entries[next].hash != 0 && ProbeDistance(h, h->entries[next].hash, next) > 0;
+	 i = next, next = (next + 1) & mask) {
+	h->entries[i] = h->entries[next];
+    }
+    memset(&h->entries[i], 0, sizeof(HashEntry));
+    h->count--;
+    return true;
+}
+
+void HashSet(Hash *h, String key, void *value)
+{
+    Store(h, key, (HashValue) { .ptr = value });
+}
+
+void HashSetInt(Hash *h, String key, intptr_t value)
+{
+    Store(h, key, (HashValue) { .integer = value });
+}
+
+#ifdef HASH_BENCHMARK
+// 以前のチェイン法の実装と比べる。エディタが実際に引くキー、つまり文
+// 書の各文字と各トークンを、引いて無ければ登録するという順で与える。
+//
+//   gcc -O2 -std=c11 -DHASH_BENCHMARK -o hash-bench hash.c utf8-string.c utf8-validate.c text_source.c -lgc
+//   ./hash-bench FILE
+#include <stdlib.h>
+#include <time.h>
+#include "text_source.h"
+#include "utf8-string.h"
+
+typedef struct _List {
+    String key;
+    void *data;
+    struct _List *next;
+} List;
+
+typedef struct {
+    List **bins;
+    size_t num_bins;
+} OldHash;
+
 // djb2
-static unsigned long hash(const unsigned char *str, size_t bytes)
+static unsigned long OldHashFunction(const unsigned char *str, size_t bytes)
 {
     unsigned long hash = 5381;
     int c;
@@ -18,63 +221,123 @@ static unsigned long hash(const unsigned char *str, size_t bytes)
     return hash;
 }
 
-Hash *HashCreateN(size_t n)
+static OldHash *OldHashCreateN(size_t n)
 {
-    Hash *h = GC_MALLOC(sizeof(Hash));
+    OldHash *h = GC_MALLOC(sizeof(OldHash));
     h->bins = GC_MALLOC(sizeof(List *) * n);
     h->num_bins = n;
     return h;
 }
 
-void *HashGet(Hash *h, String key)
+static void *OldHashGet(OldHash *h, String key)
 {
-    size_t index = hash((const unsigned char*) key.buf, key.bytes) % h->num_bins;
+    size_t index = OldHashFunction((const unsigned char*) key.buf, key.bytes) % h->num_bins;
 
-    List *bin = h->bins[index];
-
-    while (bin) {
+    for (List *bin = h->bins[index]; bin; bin = bin->next) {
 	if (key.bytes == bin->key.bytes &&
 	    strncmp(key.buf, bin->key.buf, key.bytes) == 0) {
 	    return bin->data;
 	}
-	bin = bin->next;
     }
     return NULL;
 }
 
-void HashSet(Hash *h, String key, void *value)
+static void OldHashSet(OldHash *h, String key, void *value)
 {
-    size_t index = hash((const unsigned char*) key.buf, key.bytes) % h->num_bins;
+    size_t index = OldHashFunction((const unsigned char*) key.buf, key.bytes) % h->num_bins;
 
-    List *bin = h->bins[index];
+    for (List *bin = h->bins[index]; bin; bin = bin->next) {
+	if (key.bytes == bin->key.bytes &&
+	    memcmp(key.buf, bin->key.buf, key.bytes) == 0) {
+	    bin->data = value;
+	    return;
+	}
+    }
+    List *node = GC_MALLOC(sizeof(List));
+    node->key = key;
+    node->key.buf = GC_STRNDUP(key.buf, key.bytes);
+    node->data = value;
+    node->next = h->bins[index];
+    h->bins[index] = node;
+}
+
+static String *CollectKeys(const TextSource *src, bool words, size_t *nkeys_return)
+{
+    size_t capacity = src->length + 1;
+    String *keys = GC_MALLOC_ATOMIC(sizeof(String) * capacity);
+    size_t n = 0;
 
-    if (bin == NULL) {
-    Prepend:
-	h->bins[index] = GC_MALLOC(sizeof(List));
-	h->bins[index]->key = key;
-	h->bins[index]->data = value;
-	h->bins[index]->key.buf = GC_STRNDUP(key.buf, key.bytes);
-	h->bins[index]->next = bin;
+    if (words) {
+	size_t start = 0, end;
+	while (NextTokenBilingual(src->text, start, &end)) {
+	    keys[n++] = (String) { src->text + start, end - start };
+	    start = end;
+	}
     } else {
-	while (bin) {
-	    if (key.bytes == bin->key.bytes &&
-		memcmp(key.buf, bin->key.buf, key.bytes) == 0) {
-		bin->data = value;
-		return;
+	for (const char *p = src->text; p < src->text + src->length; p = Utf8AdvanceChar(p))
+	    keys[n++] = (String) { p, Utf8CharBytes(p) };
+    }
+    *nkeys_return = n;
+    return keys;
+}
+
+#define REPEAT 20
+
+static double Now(void)
+{
+    return (double) clock() / CLOCKS_PER_SEC;
+}
+
+static void Run(const char *label, const String *keys, size_t nkeys)
+{
+    static int dummy;
+    double start;
+    size_t misses;
+
+    start = Now();
+    misses = 0;
+    for (int r = 0; r < REPEAT; r++) {
+	OldHash *h = OldHashCreateN(4096);
+	for (size_t i = 0; i < nkeys; i++) {
+	    if (!OldHashGet(h, keys[i])) {
+		misses++;
+		OldHashSet(h, keys[i], &dummy);
 	    }
-	    bin = bin->next;
 	}
-	bin = h->bins[index];
-	goto Prepend;
     }
+    printf("%-6s chained:    %8.2f ns/key  (%zu distinct)\n", label,
+	   (Now() - start) * 1e9 / (nkeys * REPEAT), misses / REPEAT);
+
+    start = Now();
+    misses = 0;
+    for (int r = 0; r < REPEAT; r++) {
+	Hash *h = HashCreateN(16);
+	for (size_t i = 0; i < nkeys; i++) {
+	    intptr_t value;
+	    if (!HashGetInt(h, keys[i], &value)) {
+		misses++;
+		HashSetInt(h, keys[i], i);
+	    }
+	}
+    }
+    printf("%-6s open addr.: %8.2f ns/key  (%zu distinct)\n", label,
+	   (Now() - start) * 1e9 / (nkeys * REPEAT), misses / REPEAT);
 }
 
-#if 0
-int main()
+int main(int argc, char *argv[])
 {
-    Hash *h = HashCreateN(1024);
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s FILENAME\n", argv[0]);
+	exit(1);
+    }
+    TextSource *src = TextSourceOpen(argv[1]);
+
+    size_t nchars, nwords;
+    String *chars = CollectKeys(src, false, &nchars);
+    String *words = CollectKeys(src, true, &nwords);
 
-    HashSet(h, (String) { "abc", 3 }, "def");
-    printf("%s\n", (char*) HashGet(h, (String) { GC_STRDUP("abc"), 3 }));
+    Run("chars", chars, nchars);
+    Run("words", words, nwords);
+    return 0;
 }
 #endif
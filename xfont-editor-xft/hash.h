@@ -1,25 +1,47 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct _String {
     const char *buf;
     size_t bytes;
 } String;
 
-typedef struct _List {
-    String key;
-    void *data;
-    struct _List *next;
-} List;
+// これより短いキーはエントリの中に直接置く。
+#define HASH_INLINE_KEY_SIZE 16
+
+typedef union {
+    void *ptr;
+    intptr_t integer;
+} HashValue;
+
+// ロビンフッド法によるオープンアドレス法のエントリ。
+typedef struct {
+    // キーのハッシュ値。0 ならば空きである。
+    uint32_t hash;
+    uint32_t bytes;
+    union {
+	char inline_key[HASH_INLINE_KEY_SIZE];
+	const char *key;
+    };
+    HashValue value;
+} HashEntry;
 
 typedef struct _Hash {
-    List **bins;
-    size_t num_bins;
+    HashEntry *entries;
+    // 2 のべき乗。
+    size_t capacity;
+    size_t count;
 } Hash;
 
 Hash *HashCreateN(size_t n);
 void *HashGet(Hash *h, String key);
-Hash *HashCreateN(size_t n);
+bool HashGetInt(Hash *h, String key, intptr_t *value_return);
+bool HashRemove(Hash *h, String key);
 void HashSet(Hash *h, String key, void *value);
+void HashSetInt(Hash *h, String key, intptr_t value);
 
 #endif
@@ -0,0 +1,227 @@
+// フォントごとの文字の寸法を保存するファイル。
+//
+//   ファイルはヘッダと 65536 個の GlyphMetrics からなる。共有マップす
+//   るので、YFont が書き込んだ寸法はそのままファイルに残り、次に同じ
+//   フォントを開いたときに Xft に問い合わせずに済む。まだ書かれていな
+//   いページはディスクを消費しない。
+//
+//   複数のエディタが同じファイルを共有する。寸法を書くときは known
+//   を最後に release で書くので、他のプロセスが known を acquire で
+//   読めば、書きかけの寸法を見ることは無い。ファイルは開いた後は作り
+//   直さない。作り直すときは別のファイルを作って置き換える。
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics_cache.h"
+
+#define MAGIC "XFMC"
+#define VERSION 1
+#define NGLYPHS 0x10000
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t glyph_size;
+    uint32_t reserved;
+    uint64_t pattern_hash;
+    // フォントファイルの状態。変わっていれば中身を捨てる。
+    int64_t font_mtime_sec;
+    int64_t font_mtime_nsec;
+    int64_t font_size;
+} CacheHeader;
+
+// FNV-1a
+static uint64_t HashString(const char *str)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *p = (const unsigned char *) str; *p; p++) {
+	hash ^= *p;
+	hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// 寸法に影響するパターンの値を文字列にする。
+static void DescribePattern(FcPattern *pattern, char *buf, size_t size)
+{
+    FcChar8 *file = (FcChar8 *) "";
+    int index = 0, hint_style = -1;
+    double pixel_size = 0;
+    FcMatrix matrix = { 1, 0, 0, 1 };
+    FcMatrix *pmatrix;
+    FcBool hinting = FcTrue, antialias = FcTrue, embolden = FcFalse;
+
+    FcPatternGetString(pattern, FC_FILE, 0, &file);
+    FcPatternGetInteger(pattern, FC_INDEX, 0, &index);
+    FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &pixel_size);
+    if (FcPatternGetMatrix(pattern, FC_MATRIX, 0, &pmatrix) == FcResultMatch)
+	matrix = *pmatrix;
+    FcPatternGetBool(pattern, FC_HINTING, 0, &hinting);
+    FcPatternGetInteger(pattern, FC_HINT_STYLE, 0, &hint_style);
+    FcPatternGetBool(pattern, FC_ANTIALIAS, 0, &antialias);
+    FcPatternGetBool(pattern, FC_EMBOLDEN, 0, &embolden);
+
+    snprintf(buf, size, "%s:%d:%g:%g,%g,%g,%g:%d:%d:%d:%d",
+	     (char *) file, index, pixel_size,
+	     matrix.xx, matrix.xy, matrix.yx, matrix.yy,
+	     hinting, hint_style, antialias, embolden);
+}
+
+// buf に書式 format で書く。size に収まらずに切れるならば false を返
+// す。切れたパスを開いたり作ったりしないようにする。
+static bool FormatPath(char *buf, size_t size, const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    int n = vsnprintf(buf, size, format, ap);
+    va_end(ap);
+    return n >= 0 && (size_t) n < size;
+}
+
+// ディレクトリ path を、無い親ディレクトリも含めて作る。
+static bool MakeDirectories(const char *path)
+{
+    char buf[4096];
+    if (!FormatPath(buf, sizeof(buf), "%s", path))
+	return false;
+
+    for (char *p = buf + 1; ; p++) {
+	if (*p == '/' || *p == '\0') {
+	    char c = *p;
+	    *p = '\0';
+	    if (mkdir(buf, 0700) == -1 && errno != EEXIST)
+		return false;
+	    if (c == '\0')
+		return true;
+	    *p = c;
+	}
+    }
+}
+
+// キャッシュを置くディレクトリを作り、そのパスを返す。
+static bool CacheDirectory(char *buf, size_t size)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    char base[4096];
+
+    if (xdg && xdg[0] == '/') {
+	if (!FormatPath(base, sizeof(base), "%s", xdg))
+	    return false;
+    } else {
+	const char *home = getenv("HOME");
+	if (!home || !FormatPath(base, sizeof(base), "%s/.cache", home))
+	    return false;
+    }
+    return FormatPath(buf, size, "%s/xfont-editor", base) && MakeDirectories(buf);
+}
+
+#define FILE_SIZE (sizeof(CacheHeader) + sizeof(GlyphMetrics) * NGLYPHS)
+
+// path のファイルをマップし、ヘッダが expected と同じならばそれを返す。
+// 無いか、形式かフォントの状態が違えば NULL を返す。
+static char *MapExisting(const char *path, const CacheHeader *expected)
+{
+    int fd = open(path, O_RDWR);
+    if (fd == -1)
+	return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size != FILE_SIZE) {
+	close(fd);
+	return NULL;
+    }
+    char *base = mmap(NULL, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+	return NULL;
+
+    if (memcmp(base, expected, sizeof(CacheHeader)) != 0) {
+	munmap(base, FILE_SIZE);
+	return NULL;
+    }
+    return base;
+}
+
+// 空のキャッシュファイルを一時ファイルとして作ってから path に置き換
+// える。古いファイルをマップしている他のプロセスは古い寸法をそちらに
+// 書き続けるので、新しいファイルには混ざらない。同時に作り直したとき
+// は後から置き換えた方が残り、先のプロセスの分は捨てられるだけである。
+static char *MapNew(const char *dir, const char *path, const CacheHeader *header)
+{
+    char tmp[4200];
+    if (!FormatPath(tmp, sizeof(tmp), "%s/metrics-XXXXXX", dir))
+	return NULL;
+
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+	return NULL;
+    // 大きさを決めるだけで、寸法の領域は 0 で埋まる。
+    if (ftruncate(fd, FILE_SIZE) == -1) {
+	close(fd);
+	unlink(tmp);
+	return NULL;
+    }
+    char *base = mmap(NULL, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+	unlink(tmp);
+	return NULL;
+    }
+
+    memcpy(base, header, sizeof(CacheHeader));
+    if (rename(tmp, path) == -1) {
+	// このプロセスだけで使う。
+	unlink(tmp);
+    }
+    return base;
+}
+
+GlyphMetrics *MetricsCacheOpen(XftFont *xft_font)
+{
+    char description[8192];
+    DescribePattern(xft_font->pattern, description, sizeof(description));
+    uint64_t pattern_hash = HashString(description);
+
+    FcChar8 *font_file;
+    struct stat font_st;
+    if (FcPatternGetString(xft_font->pattern, FC_FILE, 0, &font_file) != FcResultMatch ||
+	stat((char *) font_file, &font_st) == -1)
+	return NULL;
+
+    char dir[4096], path[4200];
+    if (!CacheDirectory(dir, sizeof(dir)) ||
+	!FormatPath(path, sizeof(path), "%s/metrics-%016llx.bin", dir, (unsigned long long) pattern_hash))
+	return NULL;
+
+    CacheHeader expected;
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.magic, MAGIC, 4);
+    expected.version = VERSION;
+    expected.glyph_size = sizeof(GlyphMetrics);
+    expected.pattern_hash = pattern_hash;
+    expected.font_mtime_sec = font_st.st_mtim.tv_sec;
+    expected.font_mtime_nsec = font_st.st_mtim.tv_nsec;
+    expected.font_size = font_st.st_size;
+
+    // 使えるファイルは書き換えずにそのまま共有する。新しいフォントか、
+    // フォントが更新されたか、知らない形式ならば作り直す。
+    char *base = MapExisting(path, &expected);
+    if (base == NULL)
+	base = MapNew(dir, path, &expected);
+    if (base == NULL)
+	return NULL;
+    return (GlyphMetrics *) (base + sizeof(CacheHeader));
+}
@@ -0,0 +1,40 @@
+#ifndef METRICS_CACHE_H
+#define METRICS_CACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <X11/Xft/Xft.h>
+
+// 1 文字の寸法。XGlyphInfo のうち使うものだけを持つ。キャッシュファイ
+// ルにはこの構造体がそのまま書かれる。
+typedef struct
+{
+    short x_off;
+    short x;
+    short y;
+    unsigned short width;
+    unsigned short height;
+    // 他の欄を書き終えてから GlyphMetricsPublish で立てる。
+    atomic_bool known;
+} GlyphMetrics;
+
+// 他のプロセスが書いているかもしれないので、known は acquire で読む。
+static inline bool GlyphMetricsIsKnown(GlyphMetrics *metrics)
+{
+    return atomic_load_explicit(&metrics->known, memory_order_acquire);
+}
+
+// 寸法を書き終えたことを示す。
+static inline void GlyphMetricsPublish(GlyphMetrics *metrics)
+{
+    atomic_store_explicit(&metrics->known, true, memory_order_release);
+}
+
+// $XDG_CACHE_HOME/xfont-editor/ 以下のキャッシュファイルを共有マップ
+// し、BMP の符号位置で引ける GlyphMetrics の配列 (65536 要素) を返す。
+// ファイルはフォントのパターンから求めたハッシュ値で選ばれ、フォント
+// ファイルの更新時刻か大きさが変わっていれば新しいファイルに置き換え
+// られる。使えなければ NULL を返す。
+GlyphMetrics *MetricsCacheOpen(XftFont *xft_font);
+
+#endif
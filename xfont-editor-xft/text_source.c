@@ -0,0 +1,116 @@
+// mmap を使ったテキストの読み込み。
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gc.h>
+
+#include "text_source.h"
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+// パイプや標準入力のように mmap できないものを、ヒープに読み込む。
+static void ReadAll(int fd, TextSource *src)
+{
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t length = 0;
+    char *buf = GC_MALLOC_ATOMIC(capacity + 1);
+
+    while (1) {
+	if (length == capacity) {
+	    capacity *= 2;
+	    buf = GC_REALLOC(buf, capacity + 1);
+	}
+
+	ssize_t bytes_read = read(fd, buf + length, capacity - length);
+	if (bytes_read == -1) {
+	    perror("read");
+	    exit(1);
+	} else if (bytes_read == 0) {
+	    break;
+	}
+	length += bytes_read;
+    }
+    buf[length] = '\0';
+
+    src->text = buf;
+    src->length = length;
+    src->mapped_size = 0;
+}
+
+// ファイルを mmap する。できなければ false を返す。
+//
+//   ファイルの大きさがページサイズの倍数だと、マップの直後に読める
+//   バイトが無い。そこで 1 バイト余分に無名マップで予約しておき、その
+//   先頭にファイルを重ねる。予約した領域の残りは 0 なので番兵になる。
+static bool MapFile(int fd, size_t length, TextSource *src)
+{
+    if (length == 0)
+	return false;
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t mapped_size = (length + 1 + page_size - 1) / page_size * page_size;
+
+    char *region = mmap(NULL, mapped_size, PROT_READ,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+	return false;
+
+    if (mmap(region, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+	munmap(region, mapped_size);
+	return false;
+    }
+    // 文書は先頭から順に一度だけ読まれる。
+    madvise(region, length, MADV_SEQUENTIAL);
+
+    src->text = region;
+    src->length = length;
+    src->mapped_size = mapped_size;
+    return true;
+}
+
+TextSource *TextSourceOpen(const char *filepath)
+{
+    TextSource *src = GC_MALLOC(sizeof(TextSource));
+    int fd;
+
+    if (strcmp(filepath, "-") == 0) {
+	fd = STDIN_FILENO;
+    } else {
+	fd = open(filepath, O_RDONLY);
+	if (fd == -1) {
+	    perror(filepath);
+	    exit(1);
+	}
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+	perror(filepath);
+	exit(1);
+    }
+
+    if (!(S_ISREG(st.st_mode) && MapFile(fd, st.st_size, src)))
+	ReadAll(fd, src);
+
+    // マップはファイル記述子を閉じても有効である。
+    if (fd != STDIN_FILENO)
+	close(fd);
+
+    return src;
+}
+
+void TextSourceClose(TextSource *src)
+{
+    if (src->mapped_size > 0)
+	munmap((void *) src->text, src->mapped_size);
+    src->text = NULL;
+    src->length = 0;
+    src->mapped_size = 0;
+}
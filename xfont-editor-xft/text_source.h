@@ -0,0 +1,21 @@
+#ifndef TEXT_SOURCE_H
+#define TEXT_SOURCE_H
+
+#include <stddef.h>
+
+// 読み出し専用のテキスト。
+//
+//   通常のファイルは mmap されるので、本文はヒープにコピーされない。
+//   text[length] には必ず '\0' がある。
+typedef struct {
+    const char *text;
+    size_t length;
+    // mmap した領域の大きさ。0 の場合 text はヒープ上にある。
+    size_t mapped_size;
+} TextSource;
+
+// filepath が "-" の場合は標準入力から読む。
+TextSource *TextSourceOpen(const char *filepath);
+void TextSourceClose(TextSource *src);
+
+#endif
@@ -6,28 +6,32 @@
 #include <assert.h>
 
 #include "utf8-string.h"
+#include "char_class.h"
 
+// 先頭の文字のバイト数を返す。不正なバイト列は 1 バイトの文字として
+// 扱う。継続バイトを確かめるので、途中の NUL 文字を越えて読むことはない。
 size_t Utf8CharBytes(const char *utf8) {
-    unsigned char b = *utf8;
-    unsigned char c = b & 0xc0;
+    const unsigned char *p = (const unsigned char *) utf8;
+    size_t n;
 
-    if (c == 0x00 ||
-	c == 0x40) {
+    if (p[0] < 0xc2) {
+	// ASCII、継続バイト、あるいは冗長な 2 バイトの先導バイト。
 	return 1;
-    } else if (c == 0xc0) {
-	if (b >> 1 == 126) {
-	    return 6;
-	} else if (b >> 2 == 62) {
-	    return 5;
-	} else if (b >> 3 == 30) {
-	    return 4;
-	} else if (b >> 4 == 14) {
-	    return 3;
-	} else if (b >> 5 == 6) {
-	    return 2;
-	}
+    } else if (p[0] < 0xe0) {
+	n = 2;
+    } else if (p[0] < 0xf0) {
+	n = 3;
+    } else if (p[0] < 0xf5) {
+	n = 4;
+    } else {
+	return 1;
+    }
+
+    for (size_t i = 1; i < n; i++) {
+	if ((p[i] & 0xc0) != 0x80)
+	    return 1;
     }
-    abort();
+    return n;
 }
 
 // NUL文字でも停止しない。
@@ -38,22 +42,19 @@ const char *Utf8AdvanceChar(const char *utf8)
 
 size_t Utf8CountChars(const char *utf8)
 {
-    size_t count;
-
-    count = 0;
-    while (*utf8 != '\0') {
-	utf8 = Utf8AdvanceChar(utf8);
-	count++;
-    }
-
-    return count;
+    return Utf8CountCharsBuffer(utf8, strlen(utf8));
 }
 
 size_t Utf8CountCharsBuffer(const char *utf8, size_t length)
 {
-    const char *p = utf8;
-    size_t count = 0;
+    size_t count;
 
+    if (Utf8Validate(utf8, length, &count, NULL))
+	return count;
+
+    // 不正なバイト列を含む場合は、Utf8CharBytes と同じ数え方をする。
+    const char *p = utf8;
+    count = 0;
     while (p < utf8 + length) {
 	p = Utf8AdvanceChar(p);
 	count++;
@@ -62,38 +63,6 @@ size_t Utf8CountCharsBuffer(const char *utf8, size_t length)
     return count;
 }
 
-char *ReadFile(const char *filepath)
-{
-    FILE *file;
-
-    file = fopen(filepath, "r");
-    if (file == NULL) {
-	perror("fopen");
-	exit(1);
-    }
-
-    fseek(file, 0, SEEK_END);
-
-    long length;
-    length = ftell(file);
-
-    rewind(file);
-
-    char *buf = GC_MALLOC(length);
-
-    size_t bytes_read;
-    bytes_read = fread(buf, 1, length, file);
-
-    if (bytes_read != length) {
-	fprintf(stderr, "file size mismatch");
-	exit(1);
-    }
-
-    fclose(file);
-
-    return buf;
-}
-
 int Utf8IsAnyOf(const char *utf8, const char *klass)
 {
     assert(utf8 != NULL);
@@ -110,6 +79,33 @@ int Utf8IsAnyOf(const char *utf8, const char *klass)
     return 0;
 }
 
+// 符号位置 cp を UTF-8 にして utf8 に書き、そのバイト数を返す。NUL 終
+// 端はしない。utf8 は 4 バイトの領域を持つこと。
+size_t Utf8EncodeChar(uint32_t cp, char *utf8)
+{
+    unsigned char *p = (unsigned char *) utf8;
+
+    if (cp < 0x80) {
+	p[0] = cp;
+	return 1;
+    } else if (cp < 0x800) {
+	p[0] = 0xc0 | cp >> 6;
+	p[1] = 0x80 | (cp & 0x3f);
+	return 2;
+    } else if (cp < 0x10000) {
+	p[0] = 0xe0 | cp >> 12;
+	p[1] = 0x80 | (cp >> 6 & 0x3f);
+	p[2] = 0x80 | (cp & 0x3f);
+	return 3;
+    } else {
+	p[0] = 0xf0 | cp >> 18;
+	p[1] = 0x80 | (cp >> 12 & 0x3f);
+	p[2] = 0x80 | (cp >> 6 & 0x3f);
+	p[3] = 0x80 | (cp & 0x3f);
+	return 4;
+    }
+}
+
 /* static int IsAsciiPrintable(const char *p) */
 /* { */
 /*     return Utf8CharBytes(p) == 1 && *p >= 0x21 && *p <= 0x7e; */
@@ -120,37 +116,24 @@ int CTypeOf(const char *utf8, int (*ctype_func)(int))
     return Utf8CharBytes(utf8) == 1 && ctype_func(utf8[0]);
 }
 
-int IsForbiddenAtStart(const char *utf8)
+// utf8 の先頭の文字のクラス。NUL 文字と不正なバイト列はどのクラスに
+// も属さない。
+static unsigned int Utf8CharClass(const char *utf8)
 {
-    static const char chars[] = ",)]｝、〕〉》」』】〙〗〟’”｠»"
-	"ゝゞーァィゥェォッャュョヮヵヶぁぃぅぇぉっゃゅょゎゕゖ"
-	"ㇰㇱㇲㇳㇴㇵㇶㇷㇸㇹㇷ゚ㇺㇻㇼㇽㇾㇿ々〻"
-	"‐゠–〜～"
-	"?!‼⁇⁈⁉"
-	"・:;/"
-	"。.";
-    size_t char_len;
+    size_t bytes;
+    int32_t cp = Utf8DecodeChar(utf8, Utf8CharBytes(utf8), &bytes);
 
-    for (const char *p = chars; *p != '\0'; p += char_len) {
-	char_len = Utf8CharBytes(p);
-	if (strncmp(utf8, p, char_len) == 0)
-	    return 1;
-    }
-    return 0;
+    return (cp < 0) ? 0 : CharClassOf(cp);
 }
 
-int IsForbiddenAtEnd(const char *utf8)
+int IsForbiddenAtStart(const char *utf8)
 {
-    static const char chars[] = "([｛〔〈《「『【〘〖〝‘“｟«"
-	"—…‥〳〴〵";
-    size_t char_len;
+    return (Utf8CharClass(utf8) & CHAR_FORBIDDEN_AT_START) != 0;
+}
 
-    for (const char *p = chars; *p != '\0'; p += char_len) {
-	char_len = Utf8CharBytes(p);
-	if (strncmp(utf8, p, char_len) == 0)
-	    return 1;
-    }
-    return 0;
+int IsForbiddenAtEnd(const char *utf8)
+{
+    return (Utf8CharClass(utf8) & CHAR_FORBIDDEN_AT_END) != 0;
 }
 
 // str の  start 位置からトークン(単語あるいは空白)を切り出す。
@@ -0,0 +1,443 @@
+// UTF-8 の検証と文字数の計数。
+//
+//   スカラー版と、x86-64 では SSE2 版と AVX2 版を持つ。どれを使うかは
+//   最初の呼び出し時に CPU を調べて決める。不正なバイト列に出会って
+//   も abort せず、その位置を返す。
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utf8-string.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+typedef bool (*ValidateKernel)(const unsigned char *, size_t, size_t *, size_t *);
+
+// 先頭の 1 文字を検証し、そのバイト数を返す。不正ならば 0 を返す。
+// RFC 3629 に従い、冗長な表現、サロゲート、U+10FFFF を越えるものは
+// 不正とする。
+static size_t ValidCharBytes(const unsigned char *p, size_t avail)
+{
+    unsigned char b = p[0];
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t n;
+
+    if (b < 0x80)
+	return 1;
+    else if (b < 0xc2)
+	return 0;
+    else if (b < 0xe0)
+	n = 2;
+    else if (b < 0xf0) {
+	n = 3;
+	if (b == 0xe0) lo = 0xa0;
+	if (b == 0xed) hi = 0x9f;
+    } else if (b < 0xf5) {
+	n = 4;
+	if (b == 0xf0) lo = 0x90;
+	if (b == 0xf4) hi = 0x8f;
+    } else
+	return 0;
+
+    if (avail < n)
+	return 0;
+    if (p[1] < lo || p[1] > hi)
+	return 0;
+    for (size_t i = 2; i < n; i++) {
+	if ((p[i] & 0xc0) != 0x80)
+	    return 0;
+    }
+    return n;
+}
+
+static bool ValidateScalar(const unsigned char *s, size_t length,
+			   size_t *nchars_return, size_t *error_offset_return)
+{
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i < length) {
+	size_t n = ValidCharBytes(s + i, length - i);
+	if (n == 0) {
+	    *nchars_return = count;
+	    *error_offset_return = i;
+	    return false;
+	}
+	i += n;
+	count++;
+    }
+    *nchars_return = count;
+    return true;
+}
+
+// ベクトル版がブロック p で誤りを見付けたときに、スカラー版で正確な位
+// 置を求める。誤りの原因は前のブロックの末尾で始まった文字かもしれな
+// いので、3 バイト前から最初の文字境界を探してそこから調べ直す。count
+// は p より前の非継続バイトの数である。
+static bool ResumeScalar(const unsigned char *s, size_t length, size_t p, size_t count,
+			 size_t *nchars_return, size_t *error_offset_return)
+{
+    size_t q = (p < 3) ? 0 : p - 3;
+
+    while (q < p && (s[q] & 0xc0) == 0x80)
+	q++;
+    for (size_t k = q; k < p; k++) {
+	if ((s[k] & 0xc0) != 0x80)
+	    count--; // 既に数えてある。
+    }
+
+    size_t nchars;
+    bool ok = ValidateScalar(s + q, length - q, &nchars, error_offset_return);
+    *nchars_return = count + nchars;
+    if (!ok)
+	*error_offset_return += q;
+    return ok;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// 16 バイトずつ見て、ASCII だけのブロックは読み飛ばす。それ以外の部
+// 分はスカラー版で検証する。
+static bool ValidateSSE2(const unsigned char *s, size_t length,
+			 size_t *nchars_return, size_t *error_offset_return)
+{
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 16 <= length) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+	unsigned mask = _mm_movemask_epi8(v);
+
+	if (mask == 0) {
+	    count += 16;
+	    i += 16;
+	    continue;
+	}
+
+	// ASCII の部分を数えてから、ブロックの終わりまで 1 文字ずつ進む。
+	size_t ascii = __builtin_ctz(mask);
+	count += ascii;
+	i += ascii;
+
+	size_t block_end = i - ascii + 16;
+	while (i < block_end) {
+	    size_t n = ValidCharBytes(s + i, length - i);
+	    if (n == 0) {
+		*nchars_return = count;
+		*error_offset_return = i;
+		return false;
+	    }
+	    i += n;
+	    count++;
+	}
+    }
+
+    size_t nchars;
+    bool ok = ValidateScalar(s + i, length - i, &nchars, error_offset_return);
+    *nchars_return = count + nchars;
+    if (!ok)
+	*error_offset_return += i;
+    return ok;
+}
+
+// 以下は Keiser と Lemire による検索表を使った検証。各バイトとその直前
+// のバイトの上位・下位 4 ビットで表を引き、その論理積が 0 でなければ
+// 不正である。3 バイト目と 4 バイト目が継続バイトであるべきかどうか
+// は飽和減算で求める。
+#define TOO_SHORT	(1 << 0)
+#define TOO_LONG	(1 << 1)
+#define OVERLONG_3	(1 << 2)
+#define TOO_LARGE	(1 << 3)
+#define SURROGATE	(1 << 4)
+#define OVERLONG_2	(1 << 5)
+#define TOO_LARGE_1000	(1 << 6)
+#define OVERLONG_4	(1 << 6)
+#define TWO_CONTS	(1 << 7)
+#define CARRY		(TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define TABLE16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2")))
+static inline __m256i Prev(__m256i input, __m256i prev_input, int n)
+{
+    __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    switch (n) {
+    case 1: return _mm256_alignr_epi8(input, shifted, 16 - 1);
+    case 2: return _mm256_alignr_epi8(input, shifted, 16 - 2);
+    default: return _mm256_alignr_epi8(input, shifted, 16 - 3);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i HighNibbles(__m256i v)
+{
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i CheckBlock(__m256i input, __m256i prev_input)
+{
+    const __m256i byte_1_high_table = TABLE16(
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+	TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+	TOO_SHORT | OVERLONG_2,
+	TOO_SHORT,
+	TOO_SHORT | OVERLONG_3 | SURROGATE,
+	TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m256i byte_1_low_table = TABLE16(
+	CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+	CARRY | OVERLONG_2,
+	CARRY,
+	CARRY,
+	CARRY | TOO_LARGE,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+	CARRY | TOO_LARGE | TOO_LARGE_1000,
+	CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m256i byte_2_high_table = TABLE16(
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+    __m256i prev1 = Prev(input, prev_input, 1);
+    __m256i special_cases =
+	_mm256_and_si256(
+	    _mm256_and_si256(
+		_mm256_shuffle_epi8(byte_1_high_table, HighNibbles(prev1)),
+		_mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0f)))),
+	    _mm256_shuffle_epi8(byte_2_high_table, HighNibbles(input)));
+
+    // 2 つ前が 3 バイト以上の先導バイト、あるいは 3 つ前が 4 バイトの
+    // 先導バイトならば、このバイトは継続バイトでなければならない。
+    __m256i prev2 = Prev(input, prev_input, 2);
+    __m256i prev3 = Prev(input, prev_input, 3);
+    __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char) (0xe0 - 0x80)));
+    __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char) (0xf0 - 0x80)));
+    __m256i must23_80 = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte),
+					 _mm256_set1_epi8((char) 0x80));
+
+    return _mm256_xor_si256(must23_80, special_cases);
+}
+
+// ブロックの末尾が途中で終わっている文字の先導バイトならば 0 以外。
+__attribute__((target("avx2")))
+static inline __m256i IsIncomplete(__m256i input)
+{
+    const __m256i max_value = _mm256_setr_epi8(
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	(char) (0xf0 - 1), (char) (0xe0 - 1), (char) (0xc0 - 1));
+    return _mm256_subs_epu8(input, max_value);
+}
+
+// 継続バイトでないバイトの数、つまり文字数を数える。
+__attribute__((target("avx2,popcnt")))
+static inline size_t CountLeadBytes(__m256i input)
+{
+    __m256i is_lead = _mm256_cmpgt_epi8(input, _mm256_set1_epi8((char) 0xbf));
+    return __builtin_popcount(_mm256_movemask_epi8(is_lead));
+}
+
+__attribute__((target("avx2,popcnt")))
+static bool ValidateAVX2(const unsigned char *s, size_t length,
+			 size_t *nchars_return, size_t *error_offset_return)
+{
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    size_t count = 0;
+    size_t i = 0;
+    // 最後に処理したブロックの位置と、その前までの文字数。
+    size_t last_block = 0;
+    size_t last_count = 0;
+    unsigned char tail[32];
+
+    while (i < length) {
+	__m256i input;
+	if (i + 32 <= length) {
+	    input = _mm256_loadu_si256((const __m256i *) (s + i));
+	} else {
+	    // 最後の半端なブロックは 0 で埋める。0 は ASCII なので、途中
+	    // で終わった文字は TOO_SHORT として検出される。
+	    memset(tail, 0, sizeof(tail));
+	    memcpy(tail, s + i, length - i);
+	    input = _mm256_loadu_si256((const __m256i *) tail);
+	}
+
+	__m256i error;
+	if (_mm256_movemask_epi8(input) == 0) {
+	    error = prev_incomplete;
+	} else {
+	    error = CheckBlock(input, prev_input);
+	    prev_incomplete = IsIncomplete(input);
+	}
+	if (!_mm256_testz_si256(error, error))
+	    return ResumeScalar(s, length, i, count, nchars_return, error_offset_return);
+
+	last_block = i;
+	last_count = count;
+	count += CountLeadBytes(input);
+	prev_input = input;
+	i += 32;
+    }
+    if (!_mm256_testz_si256(prev_incomplete, prev_incomplete))
+	return ResumeScalar(s, length, last_block, last_count, nchars_return, error_offset_return);
+
+    // 詰め物の 0 も数えてしまっている。
+    *nchars_return = count - (32 - length % 32) % 32;
+    return true;
+}
+
+#endif // HAVE_X86_KERNELS
+
+static bool ValidateDispatch(const unsigned char *s, size_t length,
+			     size_t *nchars_return, size_t *error_offset_return);
+
+static ValidateKernel validate_kernel = ValidateDispatch;
+
+// 初回の呼び出しで CPU に合った実装を選ぶ。
+static bool ValidateDispatch(const unsigned char *s, size_t length,
+			     size_t *nchars_return, size_t *error_offset_return)
+{
+    validate_kernel = ValidateScalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+	validate_kernel = ValidateAVX2;
+    else
+	validate_kernel = ValidateSSE2;
+#endif
+    return validate_kernel(s, length, nchars_return, error_offset_return);
+}
+
+// utf8 から length バイトを検証し、文字数を *nchars_return に設定する。
+// 不正な UTF-8 があった場合は false を返し、その位置を
+// *error_offset_return に設定する。そのとき *nchars_return はそこまで
+// の文字数である。
+bool Utf8Validate(const char *utf8, size_t length, size_t *nchars_return, size_t *error_offset_return)
+{
+    size_t error_offset = 0;
+    bool ok = validate_kernel((const unsigned char *) utf8, length, nchars_return, &error_offset);
+
+    if (error_offset_return)
+	*error_offset_return = error_offset;
+    return ok;
+}
+
+// 先頭の文字の符号位置を返し、そのバイト数を *bytes_return に設定す
+// る。bytes バイトの中に正しい UTF-8 の文字が無ければ -1 を返す。
+int32_t Utf8DecodeChar(const char *utf8, size_t bytes, size_t *bytes_return)
+{
+    const unsigned char *p = (const unsigned char *) utf8;
+    size_t n = (bytes > 0) ? ValidCharBytes(p, bytes) : 0;
+    int32_t cp;
+
+    switch (n) {
+    case 1: cp = p[0]; break;
+    case 2: cp = (p[0] & 0x1f) << 6 | (p[1] & 0x3f); break;
+    case 3: cp = (p[0] & 0x0f) << 12 | (p[1] & 0x3f) << 6 | (p[2] & 0x3f); break;
+    case 4: cp = (p[0] & 0x07) << 18 | (p[1] & 0x3f) << 12 | (p[2] & 0x3f) << 6 | (p[3] & 0x3f); break;
+    default: return -1;
+    }
+    *bytes_return = n;
+    return cp;
+}
+
+#ifdef UTF8_BENCHMARK
+// マイクロベンチマーク。
+//
+//   gcc -O2 -std=c11 -DUTF8_BENCHMARK -o utf8-bench utf8-validate.c text_source.c -lgc
+//   ./utf8-bench FILE
+#include <stdlib.h>
+#include <time.h>
+#include "text_source.h"
+
+// 以前の 1 バイトずつ進むループ。
+static size_t OldUtf8CharBytes(const char *utf8)
+{
+    unsigned char b = *utf8;
+    unsigned char c = b & 0xc0;
+
+    if (c == 0x00 || c == 0x40) {
+	return 1;
+    } else if (c == 0xc0) {
+	if (b >> 1 == 126) return 6;
+	else if (b >> 2 == 62) return 5;
+	else if (b >> 3 == 30) return 4;
+	else if (b >> 4 == 14) return 3;
+	else if (b >> 5 == 6) return 2;
+    }
+    abort();
+}
+
+static size_t OldUtf8CountCharsBuffer(const char *utf8, size_t length)
+{
+    const char *p = utf8;
+    size_t count = 0;
+
+    while (p < utf8 + length) {
+	p += OldUtf8CharBytes(p);
+	count++;
+    }
+    return count;
+}
+
+static double Now(void)
+{
+    return (double) clock() / CLOCKS_PER_SEC;
+}
+
+#define REPEAT 20
+
+static void Run(const char *name, ValidateKernel kernel, const TextSource *src)
+{
+    size_t nchars = 0, error_offset = 0;
+    bool ok = false;
+    double start = Now();
+    for (int i = 0; i < REPEAT; i++)
+	ok = kernel((const unsigned char *) src->text, src->length, &nchars, &error_offset);
+    double elapsed = Now() - start;
+    printf("%-8s %8.1f MB/s  chars=%zu %s\n", name,
+	   src->length * REPEAT / elapsed / 1e6, nchars, ok ? "valid" : "INVALID");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s FILENAME\n", argv[0]);
+	exit(1);
+    }
+    TextSource *src = TextSourceOpen(argv[1]);
+
+    size_t nchars = 0;
+    double start = Now();
+    for (int i = 0; i < REPEAT; i++)
+	nchars = OldUtf8CountCharsBuffer(src->text, src->length);
+    double elapsed = Now() - start;
+    printf("%-8s %8.1f MB/s  chars=%zu\n", "old", src->length * REPEAT / elapsed / 1e6, nchars);
+
+    Run("scalar", ValidateScalar, src);
+#ifdef HAVE_X86_KERNELS
+    Run("sse2", ValidateSSE2, src);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	Run("avx2", ValidateAVX2, src);
+#endif
+    return 0;
+}
+#endif
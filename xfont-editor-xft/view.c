@@ -9,20 +9,30 @@
 #include <X11/extensions/Xdbe.h>
 
 #include "utf8-string.h"
+#include "char_class.h"
 #include "view.h"
 #include "document.h"
 #include "font.h"
+#include "word_cache.h"
 				   
 static Display *disp;
 static Window win;
 static XdbeBackBuffer	 back_buffer;
 YFont *font;
+WordCache *word_cache;
+int layout_threads;
+bool lazy_layout;
+bool optimal_fit;
 
-static char *text;
+static TextSource *source;
 static Document *doc;
 
 static CursorPath cursor_path;
 static size_t top_line;
+// 上下に動かすときに狙う、行の左端からの位置。上下に続けて動かす間は
+// 最初の位置を保つ。
+static short preferred_x;
+static bool preferred_x_valid;
 
 #define MAX_LINES 1024
 
@@ -33,12 +43,41 @@ static bool DRAW_NEWLINE = 0;
 static bool MARK_MARGINS = 0;
 static bool DRAW_EOF = 0;
 static bool MARK_TOKENS = 0;
+static bool SHOW_CACHE_STATS = 0;
+// 文字の幅は符号位置で表を引くだけなので、普通は単語幅キャッシュを使
+// わない方が速い。
+static bool USE_WORD_CACHE = 0;
+// 行を組むスレッドの数。
+static short LAYOUT_THREADS = 1;
+// 見えている辺りの行だけを先に組み、残りは暇なときに組む。
+static bool LAZY_LAYOUT = 0;
+// 段落ごとに最適な改行位置を求める。0 ならば行に入るだけ詰める。
+static bool OPTIMAL_FIT = 0;
 
 #define DEFAULT_FONT_DESC "Source Han Sans JP-16:matrix=1 0 0 1"
 static const char *FONT_DESC = DEFAULT_FONT_DESC;
 
 static short LINE_HEIGHT = -1;
 
+// 描画に使う色。ViewInitialize で一度だけ解決する。
+static struct {
+    ColorHandle background;
+    ColorHandle text;
+    ColorHandle cursor;
+    ColorHandle leading_above;
+    ColorHandle leading_below;
+    ColorHandle baseline;
+    ColorHandle symbol;
+    ColorHandle space;
+    ColorHandle token_mark;
+    ColorHandle margin_mark;
+} theme;
+
+// 単語幅キャッシュに置くトークンの数。
+#define WORD_CACHE_CAPACITY 8192
+// 暇なときに一度に組む行の数。
+#define LAZY_LAYOUT_STEP 64
+
 // ファイルローカルな関数の宣言。
 static char *InspectString(const char *str);
 static char *InspectFcPattern(FcPattern *pat);
@@ -53,14 +92,18 @@ static void DrawBaseline(XftDraw *draw, PageInfo *page, short y);
 static void DrawNewline(XftDraw *draw, short x, short y);
 static void DrawSpace(XftDraw *draw, short x, short y, short width);
 static void InspectXGlyphInfo(XGlyphInfo *extents);
-static void DrawPrintableToken(XftDraw *draw, Token *tok, short left_margin, short y);
+static void DrawPrintableToken(XftDraw *draw, Document *doc, size_t tok, short left_margin, short y);
 static void DrawEOF(XftDraw *draw, short x, short y);
-static void DrawTab(XftDraw *draw, Token *tok, short margin_left, short y);
-static void DrawToken(XftDraw *draw, Token *tok, PageInfo *page, short y);
+static void DrawTab(XftDraw *draw, Document *doc, size_t tok, short margin_left, short y);
+static void DrawToken(XftDraw *draw, Document *doc, size_t tok, short y);
 static void DrawLineBefore(XftDraw *draw, PageInfo *page, short y);
-static void DrawLine(XftDraw *draw, PageInfo *page, VisualLine *lines, size_t index, short y);
+static void DrawLine(XftDraw *draw, Document *doc, size_t line, short y);
 static void MarkMargins(PageInfo *page);
 static void InitializeBackBuffer(void);
+static void InitializeTheme(void);
+static void PrintCacheStats(void);
+static void MoveCursorToLine(size_t line);
+static size_t VisibleLineCount(void);
 
 #define SET_OPTION_BOOL(param) if (streq(name, #param)) { param = (bool) atoi(value); goto Set; }
 #define SET_OPTION_STRING(param) if (streq(name, #param)) { param = GC_STRDUP(value); goto Set; }
@@ -75,10 +118,15 @@ void ViewSetOption(const char *name, const char *value)
     SET_OPTION_BOOL(MARK_MARGINS);
     SET_OPTION_BOOL(DRAW_EOF);
     SET_OPTION_BOOL(MARK_TOKENS);
+    SET_OPTION_BOOL(SHOW_CACHE_STATS);
+    SET_OPTION_BOOL(USE_WORD_CACHE);
+    SET_OPTION_BOOL(LAZY_LAYOUT);
+    SET_OPTION_BOOL(OPTIMAL_FIT);
 
     SET_OPTION_STRING(FONT_DESC);
 
     SET_OPTION_SHORT(LINE_HEIGHT);
+    SET_OPTION_SHORT(LAYOUT_THREADS);
 
 
     fprintf(stderr, "Warning: unknown option %s\n", InspectString(name));
@@ -113,7 +161,7 @@ static void DrawCursor(XftDraw *draw, short x, short y)
     XftFont *xft_font = font->xft_font;
 
     // 行の高さのカーソル。
-    XftDrawRect(draw, ColorGetXftColor("magenta"),
+    XftDrawRect(draw, ColorXftColor(theme.cursor),
 		x - 1, y - xft_font->ascent - LeadingAboveLine(xft_font),
 		2, LINE_HEIGHT);
 };
@@ -124,7 +172,7 @@ static void DrawLeadingAboveLine(XftDraw *draw, PageInfo *page, short y)
 
     // 上の行間を描画する。
     if (DRAW_LEADING)
-	XftDrawRect(draw, ColorGetXftColor("navajo white"),
+	XftDrawRect(draw, ColorXftColor(theme.leading_above),
 		    page->margin_left, y - xft_font->ascent - LeadingAboveLine(xft_font),
 		    page->margin_right - page->margin_left, LeadingAboveLine(xft_font));
 }
@@ -135,7 +183,7 @@ static void DrawLeadingBelowLine(XftDraw *draw, PageInfo *page, short y)
 
     // 下の行間を描画する。
     if (DRAW_LEADING)
-	XftDrawRect(draw, ColorGetXftColor("cornflower blue"),
+	XftDrawRect(draw, ColorXftColor(theme.leading_below),
 		    page->margin_left, y + xft_font->descent,
 		    page->margin_right - page->margin_left, LeadingBelowLine(xft_font));
 }
@@ -146,7 +194,7 @@ static void DrawBaseline(XftDraw *draw, PageInfo *page, short y)
 
     // 下線。
     if (DRAW_BASELINE)
-	XftDrawRect(draw, ColorGetXftColor("gray90"),
+	XftDrawRect(draw, ColorXftColor(theme.baseline),
 		    page->margin_left, y + xft_font->descent + LeadingBelowLine(xft_font),
 		    page->margin_right - page->margin_left, 1);
 }
@@ -156,7 +204,7 @@ static void DrawNewline(XftDraw *draw, short x, short y)
 {
     if (DRAW_NEWLINE)
 	XftDrawStringUtf8(draw,
-			  ColorGetXftColor("cyan4"),
+			  ColorXftColor(theme.symbol),
 			  font->xft_font,
 			  x, y,
 			  (FcChar8 *) NEWLINE_SYMBOL, sizeof(NEWLINE_SYMBOL) - 1);
@@ -167,7 +215,7 @@ static void DrawSpace(XftDraw *draw, short x, short y, short width)
     XftFont *xft_font = font->xft_font;
 
     if (DRAW_SPACE)
-	XftDrawRect(draw, ColorGetXftColor("misty rose"),
+	XftDrawRect(draw, ColorXftColor(theme.space),
 		    x, y - xft_font->ascent,
 		    width, xft_font->ascent + xft_font->descent);
 }
@@ -182,41 +230,48 @@ static void InspectXGlyphInfo(XGlyphInfo *extents)
     printf("yOff = %hd\n", extents->yOff);
 }
 
-static void DrawPrintableToken(XftDraw *draw, Token *tok, short left_margin, short y)
+static void DrawPrintableToken(XftDraw *draw, Document *doc, size_t tok, short left_margin, short y)
 {
     XftFont *xft_font = font->xft_font;
+    short tok_x = doc->token_xs[TokenSlot(doc, tok)];
+    // トークンの文字は配列の上でも続けて並ぶ。
+    size_t first = CharacterSlot(doc, TokenBegin(doc, tok));
+    size_t last = first + (TokenEnd(doc, tok) - TokenBegin(doc, tok));
+
+    for (size_t c = first; c < last; c++) {
+	FcChar32 cp = doc->code_points[c];
+	short width = doc->widths[c];
 
-    for (int i = 0; i < tok->nchars; i++) {
-	Character *ch = &tok->chars[i];
+	if (cp == 0)
+	    continue;
 
 	int offset;
-	if (Utf8IsAnyOf(ch->utf8, CC_OPEN_PAREN)) {
+	if (CharClassOf(cp) & CHAR_OPEN_PAREN) {
 	    // 右寄せ。
-	    int glyph_width = YFontTextWidth(font, ch->utf8, ch->length);
-	    offset = -(glyph_width - ch->width);
-	} else if (Utf8IsAnyOf(ch->utf8, CC_MIDDLE_DOT)) {
+	    int glyph_width = YFontCharWidth(font, cp);
+	    offset = -(glyph_width - width);
+	} else if (CharClassOf(cp) & CHAR_MIDDLE_DOT) {
 	    XGlyphInfo extents;
-	    YFontTextExtents(font, ch->utf8, ch->length, &extents);
+	    YFontCharExtents(font, cp, &extents);
 	    // offset = extents.x - extents.width / 2 + extents.xOff / 4;
 	    offset =
-		(ch->width - extents.width) / 2 + extents.x;
+		(width - extents.width) / 2 + extents.x;
 	} else {
 	    offset = 0;
 	}
 	    
 
-	XftDrawStringUtf8(draw,
-			  ColorGetXftColor("black"),
-			  xft_font,
-			  left_margin + tok->x + ch->x + offset, y,
-			  (FcChar8 *) ch->utf8,
-			  strlen(ch->utf8));
+	XftDrawString32(draw,
+			ColorXftColor(theme.text),
+			xft_font,
+			left_margin + tok_x + doc->xs[c] + offset, y,
+			&cp, 1);
     }
     if (MARK_TOKENS)
 	// トークン区切りをあらわす下線を引く。
-	XftDrawRect(draw, ColorGetXftColor("green4"),
-		    left_margin + tok->x + 2, y + xft_font->descent + LeadingBelowLine(xft_font) - 1,
-		    tok->width - 4, 2);
+	XftDrawRect(draw, ColorXftColor(theme.token_mark),
+		    left_margin + tok_x + 2, y + xft_font->descent + LeadingBelowLine(xft_font) - 1,
+		    doc->token_widths[TokenSlot(doc, tok)] - 4, 2);
 }
 
 #define EOF_SYMBOL "[EOF]"
@@ -225,7 +280,7 @@ static void DrawEOF(XftDraw *draw, short x, short y)
 {
     if (DRAW_EOF)
 	XftDrawStringUtf8(draw,
-			  ColorGetXftColor("cyan4"),
+			  ColorXftColor(theme.symbol),
 			  font->xft_font,
 			  x, y,
 			  (FcChar8 *) EOF_SYMBOL,
@@ -233,35 +288,38 @@ static void DrawEOF(XftDraw *draw, short x, short y)
 }
 
 #define TAB_SYMBOL " "
-static void DrawTab(XftDraw *draw, Token *tok, short margin_left, short y)
+static void DrawTab(XftDraw *draw, Document *doc, size_t tok, short margin_left, short y)
 {
     XftDrawStringUtf8(draw,
-		      ColorGetXftColor("cyan4"),
+		      ColorXftColor(theme.symbol),
 		      font->xft_font,
-		      margin_left + tok->x,
+		      margin_left + doc->token_xs[TokenSlot(doc, tok)],
 		      y,
 		      (FcChar8 *) TAB_SYMBOL,
 		      sizeof(TAB_SYMBOL) - 1);
 }
 
-static void DrawToken(XftDraw *draw, Token *tok, PageInfo *page, short y)
+static void DrawToken(XftDraw *draw, Document *doc, size_t tok, short y)
 {
-    if (TokenIsEOF(tok)) {
-	DrawEOF(draw, page->margin_left + tok->x, y);
+    PageInfo *page = doc->page;
+    short x = page->margin_left + doc->token_xs[TokenSlot(doc, tok)];
+
+    if (TokenIsEOF(doc, tok)) {
+	DrawEOF(draw, x, y);
     } else {
-	switch (tok->chars[0].utf8[0]) {
+	switch (doc->code_points[CharacterSlot(doc, TokenBegin(doc, tok))]) {
 	case ' ':
-	    DrawSpace(draw, page->margin_left + tok->x, y, tok->width);
+	    DrawSpace(draw, x, y, doc->token_widths[TokenSlot(doc, tok)]);
 	    break;
 	case '\n':
-	    DrawNewline(draw, page->margin_left + tok->x, y);
+	    DrawNewline(draw, x, y);
 	    break;
 	case '\t':
-	    DrawTab(draw, tok, page->margin_left, y);
+	    DrawTab(draw, doc, tok, page->margin_left, y);
 	    break;
 	default:
 	    // 普通の文字からなるトークン
-	    DrawPrintableToken(draw, tok, page->margin_left, y);
+	    DrawPrintableToken(draw, doc, tok, page->margin_left, y);
 	}
     }
 }
@@ -274,23 +332,20 @@ static void DrawLineBefore(XftDraw *draw, PageInfo *page, short y)
     DrawBaseline(draw, page, y);
 }
 
-static void DrawLine(XftDraw *draw, PageInfo *page, VisualLine *lines, size_t index, short y)
+static void DrawLine(XftDraw *draw, Document *doc, size_t line, short y)
 {
-    VisualLine *line = &lines[index];
+    PageInfo *page = doc->page;
+    size_t cursor = CursorPathToCharacterOffset(doc, cursor_path);
 
     DrawLineBefore(draw, page, y);
 
     // 行の描画
-    for (int i = 0; i < line->ntokens; i++) {
-	Token *tok = &line->tokens[i];
-
-	DrawToken(draw, tok, page, y);
+    for (size_t t = LineBegin(doc, line); t < LineEnd(doc, line); t++) {
+	DrawToken(draw, doc, t, y);
 
 	// カーソルを描画する。
-	for (int j = 0; j < tok->nchars; j++) {
-	    if (CursorPathEquals(cursor_path, (CursorPath) { index, i, j }))
-		DrawCursor(draw, page->margin_left + tok->x + tok->chars[j].x, y);
-	}
+	if (TokenBegin(doc, t) <= cursor && cursor < TokenEnd(doc, t))
+	    DrawCursor(draw, page->margin_left + doc->token_xs[TokenSlot(doc, t)] + doc->xs[CharacterSlot(doc, cursor)], y);
     }
 }
 
@@ -299,8 +354,8 @@ static size_t DrawDocument(XftDraw *draw, Document *doc, size_t start)
     XftFont *xft_font = font->xft_font;
     short y = doc->page->margin_top + LeadingAboveLine(xft_font) + xft_font->ascent;
 
-    for (size_t i = start; i < doc->nlines; i++) {
-	DrawLine(draw, doc->page, doc->lines, i, y);
+    for (size_t i = start; DocumentEnsureLine(doc, i); i++) {
+	DrawLine(draw, doc, i, y);
 	y += LINE_HEIGHT;
 
 	short next_line_ink_bottom =
@@ -324,7 +379,7 @@ static void MarkMargins(PageInfo *page)
 
     GC gc;
     gc = XCreateGC(disp, back_buffer, 0, NULL);
-    XSetForeground(disp, gc, ColorGetPixel("gray80"));
+    XSetForeground(disp, gc, ColorPixel(theme.margin_mark));
 
     // _|
     XDrawLine(disp, back_buffer, gc, lm - len, tm, lm, tm); // horizontal
@@ -357,7 +412,7 @@ void ViewRedraw()
 			     DefaultColormap(disp,DefaultScreen(disp)));
 
  Retry:
-    XftDrawRect(draw, ColorGetXftColor("white"), 0, 0, doc->page->width, doc->page->height);
+    XftDrawRect(draw, ColorXftColor(theme.background), 0, 0, doc->page->width, doc->page->height);
 
     if (MARK_MARGINS)
 	MarkMargins(doc->page);
@@ -380,6 +435,20 @@ void ViewRedraw()
 }
 
 
+static void InitializeTheme()
+{
+    theme.background = ColorIntern("white");
+    theme.text = ColorIntern("black");
+    theme.cursor = ColorIntern("magenta");
+    theme.leading_above = ColorIntern("navajo white");
+    theme.leading_below = ColorIntern("cornflower blue");
+    theme.baseline = ColorIntern("gray90");
+    theme.symbol = ColorIntern("cyan4");
+    theme.space = ColorIntern("misty rose");
+    theme.token_mark = ColorIntern("green4");
+    theme.margin_mark = ColorIntern("gray80");
+}
+
 static void InitializeBackBuffer()
 {
     Status st;
@@ -480,11 +549,12 @@ static char *InspectXftFont(XftFont *font)
 }
 
 void ViewInitialize(Display *aDisp, Window aWin, 
-		    const char *aText, PageInfo *page)
+		    TextSource *aSource, PageInfo *page)
 {
     disp = aDisp;
     win = aWin;
     ColorInitialize(disp);
+    InitializeTheme();
     InitializeBackBuffer();
     font = YFontCreate(disp, FONT_DESC);
     // フォントに設定されている高さを設定する。
@@ -496,9 +566,15 @@ void ViewInitialize(Display *aDisp, Window aWin,
 	exit(1);
     }
     puts(InspectXftFont(font->xft_font));
-    text = GC_STRDUP(aText);
+    if (USE_WORD_CACHE)
+	word_cache = WordCacheCreate(WORD_CACHE_CAPACITY);
+    layout_threads = LAYOUT_THREADS;
+    lazy_layout = LAZY_LAYOUT;
+    optimal_fit = OPTIMAL_FIT;
+    source = aSource;
     cursor_path = (CursorPath) { 0, 0, 0 };
-    doc = CreateDocument(text, page);
+    preferred_x_valid = false;
+    doc = CreateDocument(source->text, source->length, page);
 }
 
 void ViewSetPageInfo(PageInfo *page)
@@ -506,6 +582,28 @@ void ViewSetPageInfo(PageInfo *page)
     size_t offset = CursorPathToCharacterOffset(doc, cursor_path);
     DocumentSetPageInfo(doc, page);
     cursor_path = ToCursorPath(doc, offset);
+    preferred_x_valid = false;
+    if (SHOW_CACHE_STATS)
+	PrintCacheStats();
+}
+
+// 文字の寸法のキャッシュと単語幅キャッシュの命中率を表示する。
+static void PrintCacheStats()
+{
+    unsigned long glyph_lookups = font->cache_hits + font->cache_misses;
+    fprintf(stderr, "glyph cache: %lu hits, %lu misses (%.1f%%)\n",
+	    font->cache_hits, font->cache_misses,
+	    glyph_lookups ? 100.0 * font->cache_hits / glyph_lookups : 0.0);
+    if (word_cache == NULL)
+	return;
+
+    WordCacheStats stats;
+    WordCacheGetStats(word_cache, &stats);
+    unsigned long word_lookups = stats.hits + stats.misses;
+    fprintf(stderr, "word cache: %lu hits, %lu misses (%.1f%%), %lu evictions, %zu/%zu entries\n",
+	    stats.hits, stats.misses,
+	    word_lookups ? 100.0 * stats.hits / word_lookups : 0.0,
+	    stats.evictions, stats.count, stats.capacity);
 }
 
 // カーソルを一文字先に進める。状態が変更されたら true を返す。
@@ -517,6 +615,7 @@ bool ViewForwardCursor()
 	return false;
     else {
 	cursor_path = newLoc;
+	preferred_x_valid = false;
 	return true;
     }
 }
@@ -530,48 +629,161 @@ bool ViewBackwardCursor()
 	return false;
     else {
 	cursor_path = newLoc;
+	preferred_x_valid = false;
 	return true;
     }
 }
 
+// カーソルを行 line の、狙っている位置に動かす。
+static void MoveCursorToLine(size_t line)
+{
+    if (!preferred_x_valid) {
+	preferred_x = CursorPathGetX(doc, cursor_path);
+	preferred_x_valid = true;
+    }
+    cursor_path = CursorPathAtX(doc, line, preferred_x);
+}
+
 // カーソルを一行上に戻す。状態が変更されたら true を返す。
 bool ViewUpwardCursor()
 {
     if (cursor_path.line == 0)
 	return false;
 
-    short preferred_x = CursorPathGetX(doc, cursor_path);
-    CursorPath it = { cursor_path.line, 0, 0 }; // 行頭へ移動する。
+    MoveCursorToLine(cursor_path.line - 1);
+    return true;
+}
+
+// カーソルを一行下へ進める。状態が変更されたら true を返す。
+bool ViewDownwardCursor()
+{
+    if (!DocumentEnsureLine(doc, cursor_path.line + 1))
+	return false;
+
+    MoveCursorToLine(cursor_path.line + 1);
+    return true;
+}
 
-    short x;
-    do {
-	it = CursorPathBackward(doc, it);
-	x = CursorPathGetX(doc, it);
-    } while (x > preferred_x);
+// 一画面に描ける行の数。DrawDocument と同じ条件で数える。
+static size_t VisibleLineCount()
+{
+    XftFont *xft_font = font->xft_font;
+    int ink_height = LeadingAboveLine(xft_font) + xft_font->ascent + xft_font->descent;
+    int room = doc->page->margin_bottom - doc->page->margin_top - ink_height;
 
-    cursor_path = it;
+    if (room < LINE_HEIGHT)
+	return 1;
+    return room / LINE_HEIGHT + 1;
+}
 
+// ウィンドウの座標 (x, y) に最も近いカーソルの位置を返す。行の高さは
+// 一定なので、行は割り算で決まる。行の中は CursorPathAtX で二分探索
+// し、文字の右半分ならば次の位置にする。行の無いところは最寄りの行に
+// 寄せる。
+CursorPath ViewHitTest(short x, short y)
+{
+    PageInfo *page = doc->page;
+    size_t line = top_line;
+
+    if (y > page->margin_top)
+	line += (y - page->margin_top) / LINE_HEIGHT;
+    if (!DocumentEnsureLine(doc, line))
+	line = doc->nlines - 1;
+
+    short dx = x - page->margin_left;
+    CursorPath path = CursorPathAtX(doc, line, dx);
+    size_t offset = CursorPathToCharacterOffset(doc, path);
+    if (dx >= CursorPathGetX(doc, path) + doc->widths[CharacterSlot(doc, offset)] / 2) {
+	CursorPath next = CursorPathForward(doc, path);
+	if (next.line == line)
+	    path = next;
+    }
+    return path;
+}
+
+// カーソルを path に動かす。状態が変更されたら true を返す。
+bool ViewSetCursor(CursorPath path)
+{
+    if (CursorPathEquals(path, cursor_path))
+	return false;
+    cursor_path = path;
+    preferred_x_valid = false;
     return true;
 }
 
-// カーソルを一行下へ進める。状態が変更されたら true を返す。
-bool ViewDownwardCursor()
+// 一画面分上に戻す。状態が変更されたら true を返す。
+bool ViewPageUp()
 {
-    if (cursor_path.line == doc->nlines - 1)
+    size_t n = VisibleLineCount();
+
+    if (cursor_path.line == 0)
 	return false;
 
-    short preferred_x = CursorPathGetX(doc, cursor_path);
-    CursorPath it = { cursor_path.line + 1, 0, 0 }; // 次の行の行頭へ移動する。
-    CursorPath target;
+    top_line = (top_line > n) ? top_line - n : 0;
+    MoveCursorToLine((cursor_path.line > n) ? cursor_path.line - n : 0);
+    return true;
+}
 
-    do {
-	target = it;
-	if (CursorPathGetCharacter(doc, it)->length == 0)
-	    break;
-	it = CursorPathForward(doc, it);
-    } while (it.line == cursor_path.line + 1 && CursorPathGetX(doc, it) <= preferred_x);
+// 一画面分下へ進める。状態が変更されたら true を返す。
+bool ViewPageDown()
+{
+    size_t n = VisibleLineCount();
+    size_t line = cursor_path.line + n;
 
-    cursor_path = target;
+    // 文書の終わりを越えるときは最後の行へ動かす。
+    if (!DocumentEnsureLine(doc, line))
+	line = doc->nlines - 1;
+    if (line == cursor_path.line)
+	return false;
 
+    top_line += line - cursor_path.line;
+    MoveCursorToLine(line);
     return true;
 }
+
+// カーソルの位置に text を挿入し、カーソルをその後ろへ進める。
+bool ViewInsertText(const char *text, size_t length)
+{
+    size_t offset = CursorPathToCharacterOffset(doc, cursor_path);
+    size_t nchars = DocumentInsert(doc, offset, text, length);
+
+    if (nchars == 0)
+	return false;
+    cursor_path = ToCursorPath(doc, offset + nchars);
+    preferred_x_valid = false;
+    return true;
+}
+
+// カーソルの前の文字を削除する。状態が変更されたら true を返す。
+bool ViewDeleteBackward()
+{
+    size_t offset = CursorPathToCharacterOffset(doc, cursor_path);
+
+    if (offset == 0)
+	return false;
+    DocumentDelete(doc, offset - 1, 1);
+    cursor_path = ToCursorPath(doc, offset - 1);
+    preferred_x_valid = false;
+    return true;
+}
+
+// カーソルの位置の文字を削除する。状態が変更されたら true を返す。
+bool ViewDeleteForward()
+{
+    size_t offset = CursorPathToCharacterOffset(doc, cursor_path);
+
+    // EOF は消せない。
+    if (CharacterIsEOF(doc, offset))
+	return false;
+    DocumentDelete(doc, offset, 1);
+    cursor_path = ToCursorPath(doc, offset);
+    preferred_x_valid = false;
+    return true;
+}
+
+// まだ組んでいない行を少し組む。イベントが無いときに呼ぶ。まだ残って
+// いれば true を返す。
+bool ViewLayOutMore()
+{
+    return DocumentLayOutMore(doc, LAZY_LAYOUT_STEP);
+}
@@ -3,14 +3,23 @@
 
 #include <stdbool.h>
 #include "document.h"
+#include "text_source.h"
 
-void ViewInitialize(Display *aDisp, Window aWin, const char *aText, PageInfo *page);
+void ViewInitialize(Display *aDisp, Window aWin, TextSource *aSource, PageInfo *page);
 void ViewRedraw(void);
 void ViewSetOption(const char *name, const char *value);
 void ViewSetPageInfo(PageInfo *page);
 bool ViewBackwardCursor(void);
+bool ViewDeleteBackward(void);
+bool ViewDeleteForward(void);
 bool ViewDownwardCursor(void);
 bool ViewForwardCursor(void);
+CursorPath ViewHitTest(short x, short y);
+bool ViewInsertText(const char *text, size_t length);
+bool ViewLayOutMore(void);
+bool ViewPageDown(void);
+bool ViewPageUp(void);
+bool ViewSetCursor(CursorPath path);
 bool ViewUpwardCursor(void);
 
 #endif
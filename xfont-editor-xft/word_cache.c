@@ -0,0 +1,121 @@
+// 単語幅のキャッシュ。
+//
+//   エントリは配列に置き、使われた順に双方向リストで繋ぐ。キーからエ
+//   ントリの番号へは Hash で引く。
+#include <gc.h>
+#include <string.h>
+
+#include "word_cache.h"
+
+#define NIL ((size_t) -1)
+
+typedef struct {
+    char *key;
+    size_t bytes;
+    short *widths;
+    size_t nchars;
+    // 使われた順のリスト。prev の方が新しい。
+    size_t prev;
+    size_t next;
+} WordCacheEntry;
+
+struct WordCache {
+    Hash *index;
+    WordCacheEntry *entries;
+    size_t capacity;
+    size_t count;
+    // 最も新しいエントリと最も古いエントリ。
+    size_t head;
+    size_t tail;
+    WordCacheStats stats;
+};
+
+WordCache *WordCacheCreate(size_t capacity)
+{
+    WordCache *cache = GC_MALLOC(sizeof(WordCache));
+
+    cache->index = HashCreateN(capacity);
+    cache->entries = GC_MALLOC(sizeof(WordCacheEntry) * capacity);
+    cache->capacity = capacity;
+    cache->count = 0;
+    cache->head = cache->tail = NIL;
+    return cache;
+}
+
+static void Unlink(WordCache *cache, size_t i)
+{
+    WordCacheEntry *e = &cache->entries[i];
+
+    if (e->prev != NIL)
+	cache->entries[e->prev].next = e->next;
+    else
+	cache->head = e->next;
+    if (e->next != NIL)
+	cache->entries[e->next].prev = e->prev;
+    else
+	cache->tail = e->prev;
+}
+
+static void PushFront(WordCache *cache, size_t i)
+{
+    WordCacheEntry *e = &cache->entries[i];
+
+    e->prev = NIL;
+    e->next = cache->head;
+    if (cache->head != NIL)
+	cache->entries[cache->head].prev = i;
+    cache->head = i;
+    if (cache->tail == NIL)
+	cache->tail = i;
+}
+
+const short *WordCacheGet(WordCache *cache, String key)
+{
+    intptr_t i;
+
+    if (!HashGetInt(cache->index, key, &i)) {
+	cache->stats.misses++;
+	return NULL;
+    }
+    cache->stats.hits++;
+    if ((size_t) i != cache->head) {
+	Unlink(cache, i);
+	PushFront(cache, i);
+    }
+    return cache->entries[i].widths;
+}
+
+void WordCachePut(WordCache *cache, String key, const short *widths, size_t nchars)
+{
+    size_t i;
+
+    if (cache->capacity == 0)
+	return;
+
+    if (cache->count < cache->capacity) {
+	i = cache->count++;
+    } else {
+	// 最も古いエントリを再利用する。
+	i = cache->tail;
+	Unlink(cache, i);
+	HashRemove(cache->index, (String) { cache->entries[i].key, cache->entries[i].bytes });
+	cache->stats.evictions++;
+    }
+
+    WordCacheEntry *e = &cache->entries[i];
+    e->key = GC_MALLOC_ATOMIC(key.bytes);
+    memcpy(e->key, key.buf, key.bytes);
+    e->bytes = key.bytes;
+    e->widths = GC_MALLOC_ATOMIC(sizeof(short) * nchars);
+    memcpy(e->widths, widths, sizeof(short) * nchars);
+    e->nchars = nchars;
+    PushFront(cache, i);
+    HashSetInt(cache->index, key, i);
+}
+
+void WordCacheGetStats(WordCache *cache, WordCacheStats *stats_return)
+{
+    *stats_return = cache->stats;
+    stats_return->count = cache->count;
+    stats_return->capacity = cache->capacity;
+}
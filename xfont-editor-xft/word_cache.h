@@ -0,0 +1,26 @@
+#ifndef WORD_CACHE_H
+#define WORD_CACHE_H
+
+#include <stddef.h>
+#include "hash.h"
+
+// トークンを構成する文字の幅を、文字の並びで引けるようにしておく。最
+// 後に使われてから最も時間の経ったものから捨てる。
+typedef struct WordCache WordCache;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t count;
+    size_t capacity;
+} WordCacheStats;
+
+WordCache *WordCacheCreate(size_t capacity);
+// key に対応する文字幅の配列を返す。無ければ NULL を返す。
+const short *WordCacheGet(WordCache *cache, String key);
+void WordCacheGetStats(WordCache *cache, WordCacheStats *stats_return);
+// 満杯ならば最も古いものを捨てて登録する。
+void WordCachePut(WordCache *cache, String key, const short *widths, size_t nchars);
+
+#endif
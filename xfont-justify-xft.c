@@ -1,6 +1,8 @@
 /**
  * Helvetica で英文を表示するプログラム。両端揃え。
  */
+// mmap の MAP_ANONYMOUS の為に定義する。
+#define _DEFAULT_SOURCE
 
 #include <alloca.h>
 #include <assert.h>
@@ -10,6 +12,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <X11/Xft/Xft.h>
 #include <X11/Xlib.h>
@@ -109,26 +115,28 @@ int NextTokenBilingual(const char *utf8, size_t start, size_t *end)
     return 1;
 }
 
+// 不正なバイト列は 1 バイトの文字として扱う。
 static inline size_t Utf8CharBytes(const char *utf8) {
-    unsigned char b = *utf8;
+    const unsigned char *p = (const unsigned char *) utf8;
+    size_t n;
 
-    if ((b & 0xc0) == 0x00 ||
-	(b & 0xc0) == 0x40) {
+    if (p[0] < 0xc2) {
+	return 1;
+    } else if (p[0] < 0xe0) {
+	n = 2;
+    } else if (p[0] < 0xf0) {
+	n = 3;
+    } else if (p[0] < 0xf5) {
+	n = 4;
+    } else {
 	return 1;
-    } else if ((b & 0xc0) == 0xc0) {
-	if (b >> 1 == 126) {
-	    return 6;
-	} else if (b >> 2 == 62) {
-	    return 5;
-	} else if (b >> 3 == 30) {
-	    return 4;
-	} else if (b >> 4 == 14) {
-	    return 3;
-	} else if (b >> 5 == 6) {
-	    return 2;
-	}
     }
-    abort();
+
+    for (size_t i = 1; i < n; i++) {
+	if ((p[i] & 0xc0) != 0x80)
+	    return 1;
+    }
+    return n;
 }
 
 // NUL文字でも停止しない。
@@ -445,16 +453,29 @@ CursorPath ToCursorPath(Document *doc, size_t offset)
 #define DRAW_RETURN 1
 #define DRAW_MARGINS 0
 
+// 描画に使う色。Initialize で一度だけ解決する。
+struct {
+    ColorHandle background;
+    ColorHandle text;
+    ColorHandle cursor;
+    ColorHandle leading_above;
+    ColorHandle leading_below;
+    ColorHandle baseline;
+    ColorHandle symbol;
+    ColorHandle space;
+    ColorHandle margin_mark;
+} theme;
+
 void DrawCursor(XftDraw *draw, short x, short y)
 {
 #if 0
     // 文字の高さのカーソル。
-    XftDrawRect(draw, ColorGetXftColor("magenta"),
+    XftDrawRect(draw, ColorXftColor(theme.cursor),
 		x - 1, y - font->ascent,
 		2, font->ascent + font->descent);
 #else
     // 行の高さのカーソル。
-    XftDrawRect(draw, ColorGetXftColor("magenta"),
+    XftDrawRect(draw, ColorXftColor(theme.cursor),
 		x - 1, y - font->ascent - LeadingAboveLine(font),
 		2, font->height);
 #endif
@@ -464,7 +485,7 @@ void DrawLeadingAboveLine(XftDraw *draw, PageInfo *page, short y)
 {
     // 上の行間を描画する。
     if (DRAW_LEADING)
-	XftDrawRect(draw, ColorGetXftColor("navajo white"),
+	XftDrawRect(draw, ColorXftColor(theme.leading_above),
 		    page->margin_left, y - font->ascent - LeadingAboveLine(font),
 		    page->margin_right - page->margin_left, LeadingAboveLine(font));
 }
@@ -473,7 +494,7 @@ void DrawLeadingBelowLine(XftDraw *draw, PageInfo *page, short y)
 {
     // 下の行間を描画する。
     if (DRAW_LEADING)
-	XftDrawRect(draw, ColorGetXftColor("cornflower blue"),
+	XftDrawRect(draw, ColorXftColor(theme.leading_below),
 		    page->margin_left, y + font->descent,
 		    page->margin_right - page->margin_left, LeadingBelowLine(font));
 }
@@ -483,13 +504,13 @@ void DrawBaseline(XftDraw *draw, PageInfo *page, short y)
 #if 0
     // ベースラインを描画する。
     if (DRAW_BASELINE)
-	XftDrawRect(draw, ColorGetXftColor("gray90"),
+	XftDrawRect(draw, ColorXftColor(theme.baseline),
 		    page->margin_left, y,
 		    page->margin_right - page->margin_left, 1);
 #else
     // 下線。
     if (DRAW_BASELINE)
-	XftDrawRect(draw, ColorGetXftColor("gray90"),
+	XftDrawRect(draw, ColorXftColor(theme.baseline),
 		    page->margin_left, y + font->descent,
 		    page->margin_right - page->margin_left, 1);
 #endif
@@ -500,7 +521,7 @@ void DrawNewline(XftDraw *draw, short x, short y)
 {
     if (DRAW_RETURN)
 	XftDrawStringUtf8(draw,
-			  ColorGetXftColor("cyan4"),
+			  ColorXftColor(theme.symbol),
 			  font,
 			  x, y,
 			  (FcChar8 *) NEWLINE_SYMBOL, sizeof(NEWLINE_SYMBOL) - 1);
@@ -509,7 +530,7 @@ void DrawNewline(XftDraw *draw, short x, short y)
 void DrawSpace(XftDraw *draw, short x, short y, short width)
 {
     if (DRAW_SPACE)
-	XftDrawRect(draw, ColorGetXftColor("misty rose"),
+	XftDrawRect(draw, ColorXftColor(theme.space),
 		    x, y - font->ascent,
 		    width, font->ascent + font->descent);
 }
@@ -518,7 +539,7 @@ void DrawPrintableToken(XftDraw *draw, Token *tok, short y)
 {
     for (int i = 0; i < tok->nchars; i++) {
 	XftDrawStringUtf8(draw,
-			  ColorGetXftColor("black"),
+			  ColorXftColor(theme.text),
 			  font,
 			  tok->x + tok->chars[i].x, y,
 			  (FcChar8 *) tok->chars[i].utf8,
@@ -531,7 +552,7 @@ void DrawPrintableToken(XftDraw *draw, Token *tok, short y)
 void DrawEOF(XftDraw *draw, short x, short y)
 {
     XftDrawStringUtf8(draw,
-		      ColorGetXftColor("cyan4"),
+		      ColorXftColor(theme.symbol),
 		      font,
 		      x, y,
 		      (FcChar8 *) EOF_SYMBOL,
@@ -613,7 +634,7 @@ void MarkMargins(PageInfo *page)
 
     GC gc;
     gc = XCreateGC(disp, back_buffer, 0, NULL);
-    XSetForeground(disp, gc, ColorGetPixel("gray80"));
+    XSetForeground(disp, gc, ColorPixel(theme.margin_mark));
 
     // _|
     XDrawLine(disp, back_buffer, gc, lm - len, tm, lm, tm); // horizontal
@@ -651,7 +672,7 @@ void Redraw()
 				  DefaultVisual(disp,DefaultScreen(disp)), DefaultColormap(disp,DefaultScreen(disp)));
 
  Retry:
-    XftDrawRect(draw, ColorGetXftColor("white"), 0, 0, doc->page->width, doc->page->height);
+    XftDrawRect(draw, ColorXftColor(theme.background), 0, 0, doc->page->width, doc->page->height);
 
     if (DRAW_MARGINS)
 	MarkMargins(doc->page);
@@ -675,6 +696,19 @@ void Redraw()
     XdbeSwapBuffers(disp, &swap_info, 1);
 }
 
+void InitializeTheme()
+{
+    theme.background = ColorIntern("white");
+    theme.text = ColorIntern("black");
+    theme.cursor = ColorIntern("magenta");
+    theme.leading_above = ColorIntern("navajo white");
+    theme.leading_below = ColorIntern("cornflower blue");
+    theme.baseline = ColorIntern("gray90");
+    theme.symbol = ColorIntern("cyan4");
+    theme.space = ColorIntern("misty rose");
+    theme.margin_mark = ColorIntern("gray80");
+}
+
 void InitializeBackBuffer()
 {
     Status st;
@@ -695,6 +729,7 @@ void Initialize()
     disp = XOpenDisplay(NULL); // open $DISPLAY
 
     ColorInitialize(disp);
+    InitializeTheme();
 
     win = XCreateSimpleWindow(disp, DefaultRootWindow(disp), 0, 0, 640, 480, 0, 0, WhitePixel(disp, DefaultScreen(disp)));	
 
@@ -722,34 +757,64 @@ void CleanUp()
     XCloseDisplay(disp);
 }
 
-char *ReadFile(const char *filepath)
+// ファイルを読み込み、NUL 終端された文字列を返す。"-" は標準入力。
+//
+//   通常のファイルは mmap する。ファイルの大きさがページサイズの倍数
+//   でも終端の '\0' が読めるように、1 バイト余分に無名マップで予約し
+//   てからファイルを重ねる。mmap できない場合はヒープに読み込む。
+const char *ReadFile(const char *filepath)
 {
-    FILE *file;
+    int fd = STDIN_FILENO;
 
-    file = fopen(filepath, "r");
-    if (file == NULL) {
-	perror("fopen");
-	exit(1);
+    if (strcmp(filepath, "-") != 0) {
+	fd = open(filepath, O_RDONLY);
+	if (fd == -1) {
+	    perror("open");
+	    exit(1);
+	}
     }
 
-    fseek(file, 0, SEEK_END);
-
-    long length;
-    length = ftell(file);
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+	perror("fstat");
+	exit(1);
+    }
 
-    rewind(file);
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t mapped_size = (st.st_size + 1 + page_size - 1) / page_size * page_size;
+	char *region = mmap(NULL, mapped_size, PROT_READ,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-    char *buf = GC_MALLOC(length);
+	if (region != MAP_FAILED) {
+	    if (mmap(region, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+		close(fd);
+		return region;
+	    }
+	    munmap(region, mapped_size);
+	}
+    }
 
-    size_t bytes_read;
-    bytes_read = fread(buf, 1, length, file);
+    size_t capacity = 64 * 1024;
+    size_t length = 0;
+    char *buf = GC_MALLOC_ATOMIC(capacity + 1);
+    ssize_t bytes_read;
 
-    if (bytes_read != length) {
-	fprintf(stderr, "file size mismatch");
+    while ((bytes_read = read(fd, buf + length, capacity - length)) > 0) {
+	length += bytes_read;
+	if (length == capacity) {
+	    capacity *= 2;
+	    buf = GC_REALLOC(buf, capacity + 1);
+	}
+    }
+    if (bytes_read == -1) {
+	perror("read");
 	exit(1);
     }
+    buf[length] = '\0';
 
-    fclose(file);
+    if (fd != STDIN_FILENO)
+	close(fd);
 
     return buf;
 }
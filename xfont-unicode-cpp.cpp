@@ -7,6 +7,7 @@
 #include <string.h>
 #include <X11/Xlib.h>
 #include "util.h"
+#include "transcode.h"
 // time関数の為に time.h をインクルードする。
 #include <time.h>
 #include <ctype.h>
@@ -15,7 +16,6 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <iconv.h>
 
 #define FONT "-gnu-unifont-medium-r-normal-sans-16-160-75-75-c-80-iso10646-1"
 #define CHAR_HYPHEN '-'
@@ -132,38 +132,13 @@ void UsageExit()
 
 void LoadFile(const char *filepath)
 {
-    // 前半で UTF8 ファイルをロードし、後半で UCS2 に変換する。
-    FILE *fp = fopen(filepath, "r");
-    if ( fp == NULL ) {
-	perror(filepath);
-	exit(1);
-    }
-    struct stat st;
-    if ( stat(filepath, &st) == -1 ) {
-	perror(filepath);
-	exit(1);
-    }
-    char *utf8 = static_cast<char *>( alloca(st.st_size + 1) );
-    if ( fread(utf8, 1, st.st_size, fp) != static_cast<size_t>( st.st_size )) {
-	fprintf(stderr, "warning: size mismatch\n");
-    }
-    fclose(fp);
-
-    iconv_t cd = iconv_open("UCS-2BE", "UTF-8");
-
-    size_t inbytesleft = st.st_size;
-    // UTF-8 を UCS2 に変換した場合、最大で二倍のバイト数を必要とする。
-    // NUL 終端はしない。
-    size_t outbytesleft = st.st_size * 2;
-    text = static_cast<XChar2b*>( malloc(outbytesleft) );
-    char *outptr = (char *) text;
-
-    if ( iconv(cd, &utf8, &inbytesleft, &outptr, &outbytesleft) == static_cast<size_t>( -1 )) {
-	perror(PROGRAM_NAME);
-	exit(1);
-    }
-    text_length = (XChar2b *) outptr - text;
-    iconv_close(cd);
+    // テキストファイルを UCS2 に変換して読み込む。文字コードは UTF-8、
+    // EUC-JP、Shift_JIS、ISO-2022-JP から推測する。
+    // ビッグエンディアンの UCS2 は XChar2b 構造体とバイナリ互換性を持つ。
+    // BMP 外の文字は U+FFFD になる。
+    TranscodedText t = TranscodeFile(filepath, TEXT_ENCODING_AUTO, false);
+    text = t.ucs2;
+    text_length = t.length;
 }
 
 #include <X11/keysym.h>